@@ -21,15 +21,32 @@
 #define MAX(X,Y) (((X)>(Y)) ? (X) : (Y))
 #define MIN(X,Y) (((X)<(Y)) ? (X) : (Y))
 
+// 64-bit file offsets (off_t, ftello), also on 32-bit systems
+#define _FILE_OFFSET_BITS 64
+
 #include "image8bit.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "instrumentation.h"
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#define HAVE_PTHREAD 1
+#endif
+
 // The data structure
 //
 // An image is stored in a structure containing 3 fields:
@@ -41,6 +58,8 @@
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+// Width and height are ints, but an image may have more than INT_MAX
+// pixels: pixel counts, indices and sizes are always computed in size_t.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -55,6 +74,11 @@ struct image {
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel; // pixel data (a raster scan)
+  void* map;      // if not NULL, pixel points into this file mapping
+  size_t mapsize; // size of the mapping
+  ImagePool pool;      // if not NULL, ImageDestroy returns the image to it
+  struct image* next;  // next free image, while in the pool
+  struct imageCache* cache;  // derived data, if enabled (see ImageCacheEnable)
 };
 
 
@@ -78,10 +102,32 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
+
+// Contexts
+//
+// Um contexto guarda o estado de quem usa o módulo: a causa do último
+// erro, os contadores de instrumentação e um workspace.  Cada thread usa
+// o contexto que ligou com ImageUseContext, ou o contexto por omissão,
+// cujos contadores são InstrCount e cuja causa de erro é própria de cada
+// thread.
+struct imageContext {
+  char* cause;                        // error cause
+  unsigned long count[NUMCOUNTERS];   // instrumentation counters
+  ImageWorkspace ws;                  // scratch tables (or NULL, until used)
+};
+
+// Context bound to the calling thread (NULL: the default context)
+static _Thread_local ImageContext currentContext = NULL;
+
+// Error cause of the default context (per thread, like errno)
+static _Thread_local char* defaultErrCause;
 
-// Error cause
-static char* errCause;
+// Counters of the current context
+static _Thread_local unsigned long* counter = InstrCount;
+
+// Error cause of the current context
+#define errCause (*(currentContext != NULL ? &currentContext->cause : &defaultErrCause))
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -145,6 +191,44 @@ static int check(int condition, const char* failmsg) {
 }
 
 
+/// Contexts
+
+ImageContext ImageContextCreate(void) { ///
+  ImageContext ctx = calloc(1, sizeof(struct imageContext));
+  if (check(ctx != NULL, "Failed to allocate context")) ctx->cause = "";
+  return ctx;
+}
+
+void ImageContextDestroy(ImageContext* ctxp) { ///
+  assert (ctxp != NULL);
+  ImageContext ctx = *ctxp;
+  if (ctx == NULL) return;
+  if (ctx == currentContext) ImageUseContext(NULL);
+  ImageWorkspaceDestroy(&ctx->ws);
+  free(ctx);
+  *ctxp = NULL;
+}
+
+ImageContext ImageUseContext(ImageContext ctx) { ///
+  ImageContext prev = currentContext;
+  currentContext = ctx;
+  counter = (ctx != NULL) ? ctx->count : InstrCount;
+  return prev;
+}
+
+unsigned long* ImageContextCounters(ImageContext ctx) { ///
+  return (ctx != NULL) ? ctx->count : InstrCount;
+}
+
+// Workspace of the current context, created on first use, or NULL if
+// there is no context or the workspace cannot be created.
+static ImageWorkspace contextWorkspace(void) {
+  if (currentContext == NULL) return NULL;
+  if (currentContext->ws == NULL) currentContext->ws = ImageWorkspaceCreate();
+  return currentContext->ws;
+}
+
+
 /// Init Image library.  (Call once!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) { ///
@@ -155,17 +239,240 @@ void ImageInit(void) { ///
   InstrName[2]= "iterações";
 }
 
-// Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-#define COMPARACOES InstrCount[1] //macro para analise de complexidade ImageLocateSubImage
-#define ITER InstrCount[2]
+// Macros to simplify accessing instrumentation counters
+// (of the current context: see ImageUseContext):
+#define PIXMEM counter[0]
+#define COMPARACOES counter[1] //macro para analise de complexidade ImageLocateSubImage
+#define ITER counter[2]
 // Add more macros here...
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// TIP: Search for PIXMEM or counter to see where it is incremented!
 
 
 /// Image management functions
 
+// Image pools
+//
+// A pool keeps destroyed images in free lists, one per size (width,height),
+// so that new images of the same size reuse their memory instead of
+// allocating (and page-faulting) it again.  Pixel buffers are aligned to
+// cache lines (64 bytes), and large ones (huge page sized, if requested)
+// are aligned to and advised for transparent huge pages.
+
+#define POOLALIGN 64
+#define HUGEPAGE (2u << 20)
+
+// Free images of one size
+typedef struct {
+  int width, height;
+  Image free;   // list linked by next
+} PoolBucket;
+
+struct imagePool {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+  PoolBucket* bucket;
+  int nbuckets;
+  size_t maxbytes;    // limit of memory in free images
+  int huge;           // use huge pages for large buffers
+  ImagePoolStat stat;
+  int closing;        // destroyed, but some images are still in use
+};
+
+// Pool used by ImageCreate in the current thread (or NULL)
+static _Thread_local ImagePool currentPool = NULL;
+
+static void poolLock(ImagePool pool) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&pool->lock);
+#endif
+}
+
+static void poolUnlock(ImagePool pool) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+static void poolFree(ImagePool pool) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_destroy(&pool->lock);
+#endif
+  free(pool->bucket);
+  free(pool);
+}
+
+/// Create an image pool.
+ImagePool ImagePoolCreate(size_t maxbytes, int hugepages) { ///
+  ImagePool pool = calloc(1, sizeof(*pool));
+  if (!check(pool != NULL, "Failed to allocate memory for image pool")) return NULL;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init(&pool->lock, NULL);
+#endif
+  pool->maxbytes = maxbytes;
+  pool->huge = hugepages;
+  return pool;
+}
+
+/// Destroy the pool pointed to by (*poolp).
+void ImagePoolDestroy(ImagePool* poolp) { ///
+  assert (poolp != NULL);
+  ImagePool pool = *poolp;
+  if (pool == NULL) return;
+  if (currentPool == pool) currentPool = NULL;
+  poolLock(pool);
+  for (int b = 0; b < pool->nbuckets; b++) {
+    while (pool->bucket[b].free != NULL) {
+      Image img = pool->bucket[b].free;
+      pool->bucket[b].free = img->next;
+      free(img->pixel);
+      free(img);
+    }
+  }
+  pool->stat.cached = 0;
+  pool->closing = 1;
+  int last = (pool->stat.live == 0);
+  poolUnlock(pool);
+  if (last) poolFree(pool);   // else the last image returned frees it
+  *poolp = NULL;
+}
+
+/// Make ImageCreate (and the functions that create images) in the calling
+/// thread take images from pool (or allocate them normally, if NULL).
+ImagePool ImageUsePool(ImagePool pool) { ///
+  ImagePool prev = currentPool;
+  currentPool = pool;
+  return prev;
+}
+
+/// Get statistics of pool.
+void ImagePoolGetStat(ImagePool pool, ImagePoolStat* stat) { ///
+  assert (pool != NULL);
+  assert (stat != NULL);
+  poolLock(pool);
+  *stat = pool->stat;
+  poolUnlock(pool);
+}
+
+// Allocate a pixel buffer of size bytes for a pool.
+static uint8* poolAlloc(ImagePool pool, size_t size) {
+  size_t align = POOLALIGN;
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  if (pool->huge && size >= HUGEPAGE) align = HUGEPAGE;
+#endif
+  size_t rounded = (MAX(size, 1) + align - 1) / align * align;
+  uint8* p = aligned_alloc(align, rounded);
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  if (p != NULL && align == HUGEPAGE) {
+    int errsave = errno;
+    madvise(p, rounded, MADV_HUGEPAGE);   // just a hint
+    errno = errsave;
+  }
+#endif
+  return p;
+}
+
+// Take an image of the given size from pool, or allocate a new one.
+static Image poolGet(ImagePool pool, int width, int height) {
+  Image img = NULL;
+  poolLock(pool);
+  for (int b = 0; b < pool->nbuckets; b++) {
+    PoolBucket* k = &pool->bucket[b];
+    if (k->width == width && k->height == height && k->free != NULL) {
+      img = k->free;
+      k->free = img->next;
+      pool->stat.cached -= (size_t)width*height;
+      break;
+    }
+  }
+  if (img != NULL) pool->stat.hits++;
+  else pool->stat.misses++;
+  pool->stat.live++;
+  poolUnlock(pool);
+  if (img != NULL) return img;
+
+  img = malloc(sizeof(struct image));
+  uint8* pixel = (img != NULL) ? poolAlloc(pool, (size_t)width*height) : NULL;
+  if (!check(img != NULL && pixel != NULL, "Failed to allocate memory for image")) {
+    free(img);
+    poolLock(pool);
+    pool->stat.live--;
+    poolUnlock(pool);
+    return NULL;
+  }
+  img->pixel = pixel;
+  img->pool = pool;
+  return img;
+}
+
+// Return img to its pool (or free it, if the pool is full or destroyed).
+static void poolPut(Image img) {
+  ImagePool pool = img->pool;
+  size_t size = (size_t)img->width*img->height;
+  poolLock(pool);
+  pool->stat.live--;
+  PoolBucket* k = NULL;
+  if (!pool->closing && pool->stat.cached + size <= pool->maxbytes) {
+    for (int b = 0; b < pool->nbuckets && k == NULL; b++) {
+      if (pool->bucket[b].width == img->width && pool->bucket[b].height == img->height)
+        k = &pool->bucket[b];
+    }
+    if (k == NULL) {
+      PoolBucket* bucket = realloc(pool->bucket, (pool->nbuckets + 1)*sizeof(PoolBucket));
+      if (bucket != NULL) {
+        pool->bucket = bucket;
+        k = &bucket[pool->nbuckets++];
+        k->width = img->width;
+        k->height = img->height;
+        k->free = NULL;
+      }
+    }
+  }
+  if (k != NULL) {
+    img->next = k->free;
+    k->free = img;
+    pool->stat.cached += size;
+    img = NULL;
+  } else if (!pool->closing) {
+    pool->stat.evictions++;
+  }
+  int last = (pool->closing && pool->stat.live == 0);
+  poolUnlock(pool);
+  if (img != NULL) {
+    free(img->pixel);
+    free(img);
+  }
+  if (last) poolFree(pool);
+}
+
+// Create an image with uninitialized pixels, from the current pool if any.
+// (For functions that overwrite all pixels.)
+static Image newImage(int width, int height, uint8 maxval) {
+  Image img;
+  if (currentPool != NULL) {
+    img = poolGet(currentPool, width, height);
+  } else {
+    img = malloc(sizeof(struct image)); //aloca memoria para a estrutura
+    if (!check(img != NULL, "Failed to allocate memory for image")) return NULL;
+    img->pixel = malloc(sizeof(uint8)*(size_t)height*width); //aloca memoria para o array de pixeis
+    if (!check(img->pixel != NULL, "Failed to allocate memory for image pixels")) {
+      free(img);
+      return NULL;
+    }
+    img->pool = NULL;
+  }
+  if (img == NULL) return NULL;
+  img->width = width; //atribui os valores aos campos da estrutura
+  img->height = height;
+  img->maxval = maxval;
+  img->map = NULL;
+  img->mapsize = 0;
+  img->next = NULL;
+  img->cache = NULL;
+  return img;
+}
+
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
@@ -179,151 +486,259 @@ Image ImageCreate(int width, int height, uint8 maxval) {
   assert (height >= 0);
   assert (0 < maxval && maxval <= PixMax);
   
-  Image img = malloc(sizeof(struct image)); //aloca memoria para a estrutura
+  Image img = newImage(width, height, maxval);
+  if (img != NULL) memset(img->pixel, 0, (size_t)width*height); //imagem preta
+  return img;
+}
 
-  if (check(img != NULL, "Failed to allocate memory for image")){ //verifica se a memoria foi alocada
-    img->width = width; //atribui os valores aos campos da estrutura
-    img->height = height;
-    img->maxval = maxval;
-    img->pixel = malloc(sizeof(uint8)*height*width); //aloca memoria para o array de pixeis
+/// Workspaces
 
-    if (check(img->pixel != NULL, "Failed to allocate memory for image pixels")){ //verifica se a memoria foi alocada
-      return img;
-    }
-    else {
-      free(img->pixel); //liberta a memoria alocada para o array de pixeis
-      free(img); 
-      return NULL;
-    }
-  }
-  else{
-    free(img); //liberta a memoria alocada para a estrutura
-    return NULL;
-  }
-}
+// Tabelas de um workspace
+// (WS_PIX guarda pixeis, 4 por elemento, e WS_LINE os acumuladores das
+// passagens de caixa do blur gaussiano)
+enum { WS_SUM1, WS_SUM2, WS_SUMQ1, WS_SUMQ2, WS_PIX, WS_LINE, WS_NTABLES };
 
-// Declaração de ponteiros para as tabelas de soma
-int *sumtable1;
-int *sumtable2;
-int *sumtableQ1;
-int *sumtableQ2;
+struct imageWorkspace {
+  uint32_t* table[WS_NTABLES];  // tabelas de soma (WS_SUM1 também serve o blur, com 64 bits)
+  size_t cap[WS_NTABLES];   // capacidade de cada tabela (elementos)
+};
 
-static inline int G(Image img, int x, int y);
+ImageWorkspace ImageWorkspaceCreate(void) { ///
+  ImageWorkspace ws = calloc(1, sizeof(struct imageWorkspace));
+  check(ws != NULL, "Failed to allocate workspace");
+  return ws;
+}
 
-// Function to calculate sumtables
-void calculateSumTables_Quadrado(Image img1, Image img2) {
-   // Verifica se as imagens não são nulas
-  assert (img1 != NULL);
-  assert (img2 != NULL);
+void ImageWorkspaceDestroy(ImageWorkspace* wsp) { ///
+  assert (wsp != NULL);
+  if (*wsp == NULL) return;
+  for (int i = 0; i < WS_NTABLES; i++) free((*wsp)->table[i]);
+  free(*wsp);
+  *wsp = NULL;
+}
 
-  // Aloca memória para a tabela de soma Q2
-  sumtableQ2 = (int*) malloc(sizeof(int) * img2->width * img2->height);
-  // Aloca memória para a tabela de soma Q1
-  sumtableQ1 = (int*) malloc(sizeof(int) * img1->width * img1->height);
+// Make table i of ws hold at least n elements.  Existing contents are
+// not kept.  Returns nonzero on success, or 0 with errCause set.
+static int wsReserve(ImageWorkspace ws, int i, size_t n) {
+  if (n <= ws->cap[i]) return 1;
+  free(ws->table[i]);
+  ws->table[i] = malloc(n * sizeof(uint32_t));
+  ws->cap[i] = (ws->table[i] != NULL) ? n : 0;
+  return check(ws->table[i] != NULL, "Failed to allocate workspace");
+}
 
-  // Preenche a tabela de soma Q2
-  for (int x=0; x<img2->width; x++){
-    for (int y=0; y<img2->height; y++){
-      ITER++;
-      sumtableQ2[G(img2,x,y)]=ImageGetPixel(img2, x, y)*ImageGetPixel(img2, x, y);//o valor de cada elemento da tabela das somas é igual ao valor de cinzento ao quadrado do pixel (x,y) correspondente
-      if (x> 0 && y>0){                                                           //+ o valor do elemento ao quadrado (x-1,y) + o valor do elemento ao quadrado (x,y-1) - o valor do elemento ao quadrado (x-1,y-1).
-        sumtableQ2[G(img2,x,y)]-=sumtableQ2[G(img2,x-1,y-1)];                     //Para mais informações ver vídeo https://youtu.be/4Eh0y3LHTNU?si=1JzPZSPd9p0rDr-U
-      }
-      if (x > 0){
-        sumtableQ2[G(img2,x,y)]+=sumtableQ2[G(img2,x-1,y)];
-      }
-      if (y > 0){
-        sumtableQ2[G(img2,x,y)]+=sumtableQ2[G(img2,x,y-1)];
-      }
-      //As condições anteriores são necessárias para evitar que sejam somados pixeis que não pertencem à imagem
+// Declaração de ponteiros para as tabelas de soma
+// (one set per thread, so that threads may use the module concurrently;
+// they point to the tables of a workspace during ImageLocateSubImageWS)
+// As somas são calculadas módulo 2^32: as somas de retângulos (diferenças
+// de elementos das tabelas) ficam corretas enquanto cabem em 32 bits, e
+// nas comparações do locate a igualdade módulo 2^32 continua a ser uma
+// condição necessária (o resultado é sempre confirmado pixel a pixel).
+_Thread_local uint32_t *sumtable1;
+_Thread_local uint32_t *sumtable2;
+_Thread_local uint32_t *sumtableQ1;
+_Thread_local uint32_t *sumtableQ2;
+
+static inline size_t G(Image img, int x, int y);
+
+// Recalculate the elements (x, y) with x >= x0 and y >= y0 of the sum
+// tables of levels (sum) and of squared levels (sumq) of img, where
+// element (x, y) is the sum over the rectangle [0, x] x [0, y].
+// The other elements must be up to date.
+static void sumTables(Image img, uint32_t* sum, uint32_t* sumq, int x0, int y0) {
+  int w = img->width;
+  for (int y = y0; y < img->height; y++) {
+    const uint8* p = img->pixel + G(img, 0, y);
+    uint32_t* t = sum + (size_t)y * w;
+    uint32_t* tq = sumq + (size_t)y * w;
+    const uint32_t* u = (y > 0) ? t - w : NULL;    // linha de cima
+    const uint32_t* uq = (y > 0) ? tq - w : NULL;
+    // Somas da linha y até x0-1, obtidas das tabelas
+    uint32_t row = 0, rowq = 0;
+    if (x0 > 0) {
+      row = t[x0-1] - (u != NULL ? u[x0-1] : 0);
+      rowq = tq[x0-1] - (uq != NULL ? uq[x0-1] : 0);
     }
-  }
-  // Preenche a tabela de soma Q1
-  for (int x=0; x<img1->width; x++){
-    for (int y=0; y<img1->height; y++){
-      ITER++;
-      sumtableQ1[G(img1,x,y)]=ImageGetPixel(img1, x, y)*ImageGetPixel(img1, x, y);//igual ao calculo da soma Q2
-      if (x> 0 && y>0){
-        sumtableQ1[G(img1,x,y)]-=sumtableQ1[G(img1,x-1,y-1)];
-      }
-      if (x > 0){
-        sumtableQ1[G(img1,x,y)]+=sumtableQ1[G(img1,x-1,y)];
-      }
-      if (y > 0){
-        sumtableQ1[G(img1,x,y)]+=sumtableQ1[G(img1,x,y-1)];
-      }
+    for (int x = x0; x < w; x++) {
+      row += p[x];
+      rowq += (uint32_t)p[x] * p[x];
+      t[x] = row + (u != NULL ? u[x] : 0);
+      tq[x] = rowq + (uq != NULL ? uq[x] : 0);
     }
   }
-}
-// Libera memória alocada para as tabelas de soma Q1 e Q2
-void freeSumTables_Quadrado() {
-    free(sumtableQ1);
-    sumtableQ1=NULL;
-    free(sumtableQ2);
-    sumtableQ2=NULL;
+  unsigned long n = (unsigned long)(w - x0) * (img->height - y0);
+  PIXMEM += n;  // count pixel memory accesses
+  ITER += n;
 }
 
-// Função para calcular tabelas de soma
-void calculateSumTables(Image img1, Image img2) {
-  // Verifica se as imagens não são nulas
-  assert (img1 != NULL);
-  assert (img2 != NULL);
+/// Derived data caches
+
+// Um cache guarda dados derivados dos pixeis de uma imagem: as tabelas de
+// somas (de níveis e de quadrados) usadas pelo locate e o histograma, de
+// onde se obtêm o mínimo e o máximo.  As funções que alteram pixeis só
+// marcam o retângulo alterado (sujo), e os dados são atualizados quando
+// são usados, apenas na parte afetada:
+//   - nas tabelas de somas, os elementos com x >= x0 e y >= y0, onde
+//     (x0, y0) é o canto do retângulo sujo;
+//   - o histograma é a soma dos histogramas de blocos de HTILE x HTILE
+//     pixeis, e só os blocos que tocam o retângulo sujo são recontados
+//     (todos, se forem a maioria).
+
+// Side of the blocks with a histogram of their own
+#define HTILE 64
+
+// Number of levels (PixMax+1), as a constant expression
+#define NLEVELS (UINT8_MAX + 1)
+
+struct imageCache {
+  uint32_t* sum;              // tabela de somas dos níveis
+  uint32_t* sumq;             // tabela de somas dos quadrados dos níveis
+  uint16_t* tile;             // histogramas dos blocos (NLEVELS contagens cada)
+  int ntx, nty;               // número de blocos em x e em y
+  size_t hist[NLEVELS];       // histograma da imagem
+  int x0, y0, x1, y1;         // retângulo sujo [x0,x1[ x [y0,y1[ (vazio se x0 >= x1)
+};
 
-  // Aloca memória para a tabela de soma 2
-  sumtable2 = (int*) malloc(sizeof(int) * img2->width * img2->height);
-  // Aloca memória para a tabela de soma 1
-  sumtable1 = (int*) malloc(sizeof(int) * img1->width * img1->height);
-  // Preenche a tabela de soma 2
-  for (int x=0; x<img2->width; x++){
-    for (int y=0; y<img2->height; y++){
-      ITER++;
-      sumtable2[G(img2,x,y)]=ImageGetPixel(img2, x, y);     //o valor de cada elemento da tabela das somas é igual ao valor de cinzento do pixel (x,y) correspondente
-      if (x> 0 && y>0){                                     //+ o valor do elemento ao quadrado (x-1,y) + o valor do elemento ao quadrado (x,y-1) - o valor do elemento ao quadrado (x-1,y-1).
-        sumtable2[G(img2,x,y)]-=sumtable2[G(img2,x-1,y-1)]; //Para mais informações ver vídeo https://youtu.be/4Eh0y3LHTNU?si=1JzPZSPd9p0rDr-U
-      }
-      if (x > 0){
-        sumtable2[G(img2,x,y)]+=sumtable2[G(img2,x-1,y)];
-      }
-      if (y > 0){
-        sumtable2[G(img2,x,y)]+=sumtable2[G(img2,x,y-1)];
-      }
-      //As condições anteriores são necessárias para evitar que sejam somados pixeis que não pertencem à imagem
-    }
+// Mark rectangle (x, y, w, h) of img as changed, if img has a cache.
+static inline void markDirty(Image img, int x, int y, int w, int h) {
+  struct imageCache* c = img->cache;
+  if (c == NULL || w <= 0 || h <= 0) return;
+  if (c->x0 >= c->x1) {
+    c->x0 = x;  c->y0 = y;  c->x1 = x + w;  c->y1 = y + h;
+  } else {
+    c->x0 = MIN(c->x0, x);  c->y0 = MIN(c->y0, y);
+    c->x1 = MAX(c->x1, x + w);  c->y1 = MAX(c->y1, y + h);
   }
-  // Preenche a tabela de soma 1
-  for (int x=0; x<img1->width; x++){
-    for (int y=0; y<img1->height; y++){
-      ITER++;
-      sumtable1[G(img1,x,y)]=ImageGetPixel(img1, x, y);   //igual ao calculo da soma 2
-      if (x> 0 && y>0){
-        sumtable1[G(img1,x,y)]-=sumtable1[G(img1,x-1,y-1)];
-      }
-      if (x > 0){
-        sumtable1[G(img1,x,y)]+=sumtable1[G(img1,x-1,y)];
-      }
-      if (y > 0){
-        sumtable1[G(img1,x,y)]+=sumtable1[G(img1,x,y-1)];
+}
+
+// Recount the histograms of blocks [tx0,tx1[ x [ty0,ty1[ of img, and
+// update the image histogram: the old counts of the blocks are removed,
+// unless the image histogram is recounted from scratch (all != 0).
+static void countTiles(Image img, int tx0, int ty0, int tx1, int ty1, int all) {
+  struct imageCache* c = img->cache;
+  if (all) memset(c->hist, 0, sizeof(c->hist));
+  for (int ty = ty0; ty < ty1; ty++) {
+    for (int tx = tx0; tx < tx1; tx++) {
+      uint16_t* th = c->tile + ((size_t)ty * c->ntx + tx) * NLEVELS;
+      if (!all) for (int v = 0; v <= PixMax; v++) c->hist[v] -= th[v];
+      memset(th, 0, NLEVELS * sizeof(uint16_t));
+      int x0 = tx * HTILE, x1 = MIN(x0 + HTILE, img->width);
+      int y0 = ty * HTILE, y1 = MIN(y0 + HTILE, img->height);
+      for (int y = y0; y < y1; y++) {
+        const uint8* p = img->pixel + G(img, 0, y);
+        for (int x = x0; x < x1; x++) th[p[x]]++;
       }
+      for (int v = 0; v <= PixMax; v++) c->hist[v] += th[v];
+      PIXMEM += (unsigned long)(x1 - x0) * (y1 - y0);  // count pixel memory accesses
     }
   }
 }
-// Libera memória alocada para as tabelas de soma 1 e 2
-void freeSumTables() {
-  free(sumtable1);
-  sumtable1 = NULL;
-  free(sumtable2);
-  sumtable2 = NULL;
+
+// Bring the cache of img up to date with its pixels.
+static void cacheRefresh(Image img) {
+  struct imageCache* c = img->cache;
+  if (c->x0 >= c->x1) return;   // nada mudou
+  int x0 = MAX(c->x0, 0), y0 = MAX(c->y0, 0);
+  int x1 = MIN(c->x1, img->width), y1 = MIN(c->y1, img->height);
+  c->x0 = c->x1 = 0;
+  if (x0 >= x1 || y0 >= y1) return;
+  sumTables(img, c->sum, c->sumq, x0, y0);
+  int tx0 = x0 / HTILE, ty0 = y0 / HTILE;
+  int tx1 = (x1 - 1) / HTILE + 1, ty1 = (y1 - 1) / HTILE + 1;
+  if (2 * (size_t)(tx1 - tx0) * (ty1 - ty0) > (size_t)c->ntx * c->nty)
+    countTiles(img, 0, 0, c->ntx, c->nty, 1);   // a maioria dos blocos mudou
+  else
+    countTiles(img, tx0, ty0, tx1, ty1, 0);
+}
+
+int ImageCacheEnable(Image img) { ///
+  assert (img != NULL);
+  if (img->cache != NULL) return 1;
+  size_t n = (size_t)img->width * img->height;
+  int ntx = (img->width + HTILE - 1) / HTILE;
+  int nty = (img->height + HTILE - 1) / HTILE;
+  struct imageCache* c = calloc(1, sizeof(struct imageCache));
+  if (c != NULL) {
+    c->sum = malloc(MAX(n, 1) * sizeof(uint32_t));
+    c->sumq = malloc(MAX(n, 1) * sizeof(uint32_t));
+    c->tile = calloc(MAX((size_t)ntx * nty, 1) * NLEVELS, sizeof(uint16_t));
+  }
+  if (!check( c != NULL && c->sum != NULL && c->sumq != NULL && c->tile != NULL,
+              "Failed to allocate memory for cache" )) {
+    if (c != NULL) { free(c->sum); free(c->sumq); free(c->tile); }
+    free(c);
+    return 0;
+  }
+  c->ntx = ntx;
+  c->nty = nty;
+  img->cache = c;
+  markDirty(img, 0, 0, img->width, img->height);   // calculado no primeiro uso
+  return 1;
+}
+
+void ImageCacheDisable(Image img) { ///
+  assert (img != NULL);
+  struct imageCache* c = img->cache;
+  if (c == NULL) return;
+  free(c->sum);
+  free(c->sumq);
+  free(c->tile);
+  free(c);
+  img->cache = NULL;
+}
+
+// Liga as tabelas de soma às tabelas de img1 e img2: as de img1 vêm do
+// seu cache, se o tiver (atualizado), e as restantes do workspace ws.
+// Se ws for NULL, desliga-as.
+static int bindSumTables(ImageWorkspace ws, Image img1, Image img2) {
+  if (ws == NULL) {
+    sumtable1 = sumtable2 = sumtableQ1 = sumtableQ2 = NULL;
+    return 1;
+  }
+  size_t n1 = (size_t)img1->width * img1->height;
+  size_t n2 = (size_t)img2->width * img2->height;
+  if (!(wsReserve(ws, WS_SUM2, n2) && wsReserve(ws, WS_SUMQ2, n2))) return 0;
+  if (img1->cache != NULL) {
+    cacheRefresh(img1);
+    sumtable1 = img1->cache->sum;
+    sumtableQ1 = img1->cache->sumq;
+  } else {
+    if (!(wsReserve(ws, WS_SUM1, n1) && wsReserve(ws, WS_SUMQ1, n1))) return 0;
+    sumtable1 = ws->table[WS_SUM1];
+    sumtableQ1 = ws->table[WS_SUMQ1];
+    sumTables(img1, sumtable1, sumtableQ1, 0, 0);
+  }
+  sumtable2 = ws->table[WS_SUM2];
+  sumtableQ2 = ws->table[WS_SUMQ2];
+  sumTables(img2, sumtable2, sumtableQ2, 0, 0);
+  return 1;
 }
 
 /// Destroy the image pointed to by (*imgp).
-///   imgp : address of an Image variablestatic inline int G(Image img, int x, int y);.
+///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) { ///
   assert (imgp != NULL);
-  free((*imgp)->pixel); //liberta a memoria alocada para o array de pixeis
-  free(*imgp); //liberta a memoria alocada para a estrutura
+  if (*imgp == NULL) return; //nada a fazer
+  ImageCacheDisable(*imgp);
+#ifdef HAVE_MMAP
+  if ((*imgp)->map != NULL) {
+    int errsave = errno; //munmap pode alterar errno
+    munmap((*imgp)->map, (*imgp)->mapsize); //os pixeis estão no mapeamento do ficheiro
+    free(*imgp);
+    errno = errsave;
+  } else
+#endif
+  if ((*imgp)->pool != NULL) {
+    int errsave = errno;
+    poolPut(*imgp); //devolve a imagem ao pool
+    errno = errsave;
+  } else {
+    free((*imgp)->pixel); //liberta a memoria alocada para o array de pixeis
+    free(*imgp); //liberta a memoria alocada para a estrutura
+  }
   *imgp = NULL;  
 }
 
@@ -333,46 +748,364 @@ void ImageDestroy(Image* imgp) { ///
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-// Match and skip 0 or more comment lines in file f.
+// The header is parsed by hand, character by character, from the stdio
+// buffer (no fscanf).  Comments may appear between any header tokens.
+// Pixels are read in large blocks and decoded from memory.
+// Accepted formats are raw (P5) and plain/ASCII (P2) PGM, with 8 or 16 bit
+// levels (maxval up to 65535).  Since images have 8-bit pixels, 16-bit
+// levels are scaled down to [0, PixMax] while loading, through a lookup
+// table, so no intermediate 16-bit raster is ever stored.
+
+// Largest maxval in a PGM file
+#define PGMMAXVAL 65535
+
+// Size of the blocks used to read pixel data
+#define READBLOCK 65536
+
+// Skip whitespace and comments in file f.
 // Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+static void skipSpace(FILE* f) {
+  int c;
+  while ((c = getc(f)) != EOF) {
+    if (c == '#') {
+      while ((c = getc(f)) != EOF && c != '\n') { }
+    } else if (!isspace(c)) {
+      ungetc(c, f);
+      return;
+    }
+  }
+}
+
+// Read an unsigned decimal number in [0, max] from file f, after skipping
+// whitespace and comments.  Returns 1 on success, 0 otherwise.
+static int readNumber(FILE* f, int* v, int max) {
+  skipSpace(f);
+  int c = getc(f);
+  if (!isdigit(c)) return 0;
+  long n = 0;
+  do {
+    n = 10*n + (c - '0');
+    if (n > max) return 0;
+  } while (isdigit(c = getc(f)));
+  ungetc(c, f);
+  *v = (int)n;
+  return 1;
+}
+
+// Parse a PGM header from file f, setting *format ('5' for raw, '2' for
+// plain), *w, *h and *maxval (1..PGMMAXVAL).
+// On success, returns nonzero and f is positioned at the first pixel.
+// On failure, returns 0 and errCause is set.
+static int readHeader(FILE* f, char* format, int* w, int* h, int* maxval) {
+  return
+  check( getc(f) == 'P' && ((*format = (char)getc(f)) == '5' || *format == '2') , "Invalid file format" ) &&
+  check( readNumber(f, w, INT_MAX) , "Invalid width" ) &&
+  check( readNumber(f, h, INT_MAX) , "Invalid height" ) &&
+  check( readNumber(f, maxval, PGMMAXVAL) && *maxval > 0 , "Invalid maxval" ) &&
+  check( isspace(getc(f)) , "Whitespace expected" );
+}
+
+// Build a table to scale levels in [0, maxval] to [0, PixMax], rounded.
+// Returns NULL if allocation fails.
+static uint8* scaleTable(int maxval) {
+  uint8* lut = malloc((size_t)maxval + 1);
+  if (lut != NULL)
+    for (long v = 0; v <= maxval; v++)
+      lut[v] = (uint8)((v*PixMax + maxval/2) / maxval);
+  return lut;
+}
+
+// Read n 16-bit big-endian levels from f into pixel, scaled by lut.
+static int readRaw16(FILE* f, uint8* pixel, size_t n, int maxval, const uint8* lut) {
+  uint8* buf = malloc(READBLOCK);
+  if (!check(buf != NULL, "Failed to allocate memory for reading")) return 0;
+  int ok = 1;
+  for (size_t i = 0; ok && i < n; ) {
+    size_t m = MIN(n - i, READBLOCK/2);
+    ok = check( fread(buf, 2, m, f) == m, "Reading pixels" );
+    if (!ok) break;
+    // Valida o bloco antes de usar os níveis como índices da tabela:
+    // o máximo dos pares de bytes (big-endian) é calculado sem ramificações
+    unsigned vmax = 0;
+    for (size_t j = 0; j < m; j++) {
+      unsigned v = ((unsigned)buf[2*j] << 8) | buf[2*j + 1];
+      vmax = MAX(vmax, v);
+    }
+    ok = check( vmax <= (unsigned)maxval , "Invalid pixel level" );
+    if (!ok) break;
+    for (size_t j = 0; j < m; j++)
+      pixel[i + j] = lut[((unsigned)buf[2*j] << 8) | buf[2*j + 1]];
+    i += m;
   }
-  return i;
+  free(buf);
+  return ok;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+// Read n ASCII decimal levels from f into pixel, scaled by lut (if not NULL).
+static int readPlain(FILE* f, uint8* pixel, size_t n, int maxval, const uint8* lut) {
+  char* buf = malloc(READBLOCK + 1);
+  if (!check(buf != NULL, "Failed to allocate memory for reading")) return 0;
+  size_t len = 0;   // bytes in buf
+  size_t pos = 0;   // next byte to decode
+  int eof = 0;
+  int ok = 1;
+  size_t i = 0;
+  while (ok && i < n) {
+    // Manter sempre no buffer bytes suficientes para um número completo
+    if (len - pos < 16 && !eof) {
+      memmove(buf, buf + pos, len - pos);
+      len -= pos;
+      pos = 0;
+      size_t r = fread(buf + len, 1, READBLOCK - len, f);
+      eof = (len + r < READBLOCK);
+      len += r;
+      buf[len] = '\0';  // sentinela: termina qualquer número
+    }
+    while (pos < len && isspace((unsigned char)buf[pos])) pos++;
+    // Zeros à esquerda não contam para o limite de algarismos
+    while (buf[pos] == '0' && (unsigned)(buf[pos + 1] - '0') <= 9) pos++;
+    if (len - pos < 8 && !eof) continue;
+    ok = check( pos < len && (unsigned)(buf[pos] - '0') <= 9 , "Reading pixels" );
+    unsigned v = 0;
+    int digits = 0;
+    for ( ; (unsigned)(buf[pos] - '0') <= 9 && digits < 6; pos++, digits++)
+      v = 10*v + (unsigned)(buf[pos] - '0');
+    // O número tem de acabar aqui: mais algarismos seriam outro pixel
+    ok = ok && check( pos == len || isspace((unsigned char)buf[pos]) , "Invalid pixel level" );
+    ok = ok && check( v <= (unsigned)maxval , "Invalid pixel level" );
+    if (ok) pixel[i++] = (lut != NULL) ? lut[v] : (uint8)v;
+  }
+  free(buf);
+  return ok;
+}
+
+// Read the pixels of an image with given format and maxval from f.
+static int readPixels(FILE* f, Image img, char format, int maxval) {
+  size_t n = (size_t)img->width * img->height;
+  if (format == '5' && maxval <= PixMax)
+    return check( fread(img->pixel, sizeof(uint8), n, f) == n , "Reading pixels" );
+  uint8* lut = NULL;
+  if (maxval > PixMax &&
+      !check( (lut = scaleTable(maxval)) != NULL, "Failed to allocate memory for reading" ))
+    return 0;
+  int ok = (format == '5') ? readRaw16(f, img->pixel, n, maxval, lut)
+                           : readPlain(f, img->pixel, n, maxval, lut);
+  free(lut);
+  return ok;
+}
+
+/// Compact RLE files
+
+// Files with extension RLEEXT are stored in a native compact format,
+// instead of PGM.  After a header with magic "I8R1", width and height
+// (32-bit little-endian) and maxval (1 byte), each row is stored as a
+// mode byte, a 32-bit little-endian payload length, and the payload:
+//   ROW_RAW:    the row as is (read directly into the pixel array);
+//   ROW_RLE:    the row coded with PackBits;
+//   ROW_DELTA:  the differences between consecutive pixels (mod 256),
+//               coded with PackBits (good for gradients).
+// Each row is saved in the mode that gives the smallest payload.
+// PackBits: a control byte c in [0, 127] is followed by c+1 literal
+// bytes; c in [129, 255] is followed by a byte to repeat 257-c times.
+
+#define RLEEXT ".rle"
+enum { ROW_RAW, ROW_RLE, ROW_DELTA };
+
+// Check whether filename ends with extension ext.
+static int hasExtension(const char* filename, const char* ext) {
+  size_t n = strlen(filename);
+  size_t m = strlen(ext);
+  return n >= m && strcmp(filename + n - m, ext) == 0;
+}
+
+// Maximum size of a PackBits payload for n bytes
+static size_t packBound(size_t n) {
+  return n + (n + 127) / 128;
+}
+
+// Code n bytes of src with PackBits into dst.  Returns the payload size.
+static size_t packBits(const uint8* src, size_t n, uint8* dst) {
+  size_t i = 0, o = 0;
+  while (i < n) {
+    // Comprimento da repetição que começa em i
+    size_t r = 1;
+    while (i + r < n && r < 128 && src[i + r] == src[i]) r++;
+    if (r >= 3) {
+      dst[o++] = (uint8)(257 - r);
+      dst[o++] = src[i];
+      i += r;
+      continue;
+    }
+    // Literais, até à próxima repetição de 3 ou mais
+    size_t j = i;
+    while (j < n && j - i < 128 &&
+           !(j + 2 < n && src[j] == src[j + 1] && src[j] == src[j + 2])) j++;
+    dst[o++] = (uint8)(j - i - 1);
+    memcpy(dst + o, src + i, j - i);
+    o += j - i;
+    i = j;
+  }
+  return o;
+}
+
+// Decode PackBits payload src with m bytes into exactly n bytes of dst.
+// Returns 1 on success, 0 if the payload is corrupt.
+static int unpackBits(const uint8* src, size_t m, uint8* dst, size_t n) {
+  size_t i = 0, o = 0;
+  while (i < m) {
+    uint8 c = src[i++];
+    if (c < 128) {
+      size_t len = (size_t)c + 1;
+      if (i + len > m || o + len > n) return 0;
+      memcpy(dst + o, src + i, len);
+      i += len;
+      o += len;
+    } else if (c > 128) {
+      size_t len = 257 - (size_t)c;
+      if (i >= m || o + len > n) return 0;
+      memset(dst + o, src[i++], len);
+      o += len;
+    }
+  }
+  return o == n;
+}
+
+// Write/read 32-bit little-endian unsigned integers.
+static int putU32(FILE* f, uint32_t v) {
+  uint8 b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff };
+  return fwrite(b, 1, 4, f) == 4;
+}
+
+static int getU32(FILE* f, uint32_t* v) {
+  uint8 b[4];
+  if (fread(b, 1, 4, f) != 4) return 0;
+  *v = (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+  return 1;
+}
+
+// Save img to f in RLE format.
+static int saveRLE(Image img, FILE* f) {
+  size_t w = (size_t)img->width;
+  uint8* delta = malloc(w + 1);
+  uint8* rle = malloc(packBound(w) + 1);
+  uint8* drle = malloc(packBound(w) + 1);
+  int success =
+  check( delta != NULL && rle != NULL && drle != NULL, "Failed to allocate memory for coding" ) &&
+  check( fwrite("I8R1", 1, 4, f) == 4 && putU32(f, (uint32_t)img->width) &&
+         putU32(f, (uint32_t)img->height) && putc(img->maxval, f) != EOF, "Writing header failed" );
+  for (int y = 0; success && y < img->height; y++) {
+    const uint8* row = img->pixel + (size_t)y * w;
+    uint8 prev = 0;
+    for (size_t x = 0; x < w; x++) {
+      delta[x] = (uint8)(row[x] - prev);
+      prev = row[x];
+    }
+    size_t nrle = packBits(row, w, rle);
+    size_t ndelta = packBits(delta, w, drle);
+    // Escolhe o modo com menor tamanho
+    int mode = ROW_RAW;
+    const uint8* payload = row;
+    size_t m = w;
+    if (nrle < m) { mode = ROW_RLE; payload = rle; m = nrle; }
+    if (ndelta < m) { mode = ROW_DELTA; payload = drle; m = ndelta; }
+    success = check( putc(mode, f) != EOF && putU32(f, (uint32_t)m) &&
+                     fwrite(payload, 1, m, f) == m, "Writing pixels failed" );
+  }
+  free(delta);
+  free(rle);
+  free(drle);
+  return success;
+}
+
+// Parse an RLE header from file f, setting *w, *h and *maxval.
+// On success, returns nonzero and f is positioned at the first row.
+// On failure, returns 0 and errCause is set.
+static int readRLEHeader(FILE* f, int* w, int* h, int* maxval) {
+  char magic[4];
+  uint32_t uw = 0, uh = 0;
+  int success =
+  check( fread(magic, 1, 4, f) == 4 && memcmp(magic, "I8R1", 4) == 0, "Invalid file format" ) &&
+  check( getU32(f, &uw) && uw <= INT_MAX, "Invalid width" ) &&
+  check( getU32(f, &uh) && uh <= INT_MAX, "Invalid height" ) &&
+  check( (*maxval = getc(f)) != EOF && *maxval > 0, "Invalid maxval" );
+  *w = (int)uw;
+  *h = (int)uh;
+  return success;
+}
+
+// Load an image in RLE format from f.  Returns NULL on failure.
+static Image loadRLE(FILE* f) {
+  int w, h;
+  int maxval;
+  Image img = NULL;
+  uint8* buf = NULL;
+
+  int success =
+  readRLEHeader(f, &w, &h, &maxval) &&
+  (img = newImage(w, h, (uint8)maxval)) != NULL &&
+  check( (buf = malloc(packBound((size_t)w) + 1)) != NULL, "Failed to allocate memory for decoding" );
+
+  size_t n = (size_t)w;
+  for (int y = 0; success && y < h; y++) {
+    uint8* row = img->pixel + (size_t)y * n;
+    int mode = getc(f);
+    uint32_t m;
+    success = check( mode != EOF && getU32(f, &m), "Reading pixels" );
+    if (!success) break;
+    if (mode == ROW_RAW) {
+      success = check( m == n && fread(row, 1, n, f) == n, "Reading pixels" );
+    } else {
+      success =
+      check( (mode == ROW_RLE || mode == ROW_DELTA) && m <= packBound(n), "Invalid row coding" ) &&
+      check( fread(buf, 1, m, f) == m, "Reading pixels" ) &&
+      check( unpackBits(buf, m, row, n), "Invalid row coding" );
+      if (success && mode == ROW_DELTA) {
+        uint8 prev = 0;
+        for (size_t x = 0; x < n; x++) prev = row[x] = (uint8)(prev + row[x]);
+      }
+    }
+  }
+  free(buf);
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  return img;
+}
+
+/// Load a PGM file.
+/// Raw (P5) and plain (P2) PGM files are accepted, with maxval up to 65535.
+/// Levels of files with maxval > PixMax are scaled down to [0, PixMax]
+/// and the image gets maxval PixMax.
+/// Files with extension ".rle" are read in compact RLE format instead.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
   int w, h;
   int maxval;
-  char c;
+  char format;
   FILE* f = NULL;
   Image img = NULL;
 
+  if (hasExtension(filename, RLEEXT)) {
+    if (!check( (f = fopen(filename, "rb")) != NULL, "Open failed" )) return NULL;
+    img = loadRLE(f);
+    if (img != NULL) PIXMEM += (unsigned long)img->width*img->height;  // count pixel memory accesses
+    fclose(f);
+    return img;
+  }
+
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  readHeader(f, &format, &w, &h, &maxval) &&
   // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  (img = newImage(w, h, (uint8)MIN(maxval, PixMax))) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  readPixels(f, img, format, maxval);
+  if (img != NULL) PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -384,7 +1117,106 @@ Image ImageLoad(const char* filename) { ///
   return img;
 }
 
+// Current position of f, with 64 bits where supported, or -1.
+static int64_t fileTell(FILE* f) {
+#ifdef HAVE_MMAP
+  return (int64_t)ftello(f);
+#else
+  return (int64_t)ftell(f);
+#endif
+}
+
+/// Probe an image file header.
+/// Parses only the header of a PGM (or RLE) file, as ImageLoad would,
+/// and sets (*w, *h) to its size, *maxval to its maxval in the file
+/// (which may exceed PixMax), and *offset to the file position of the
+/// first pixel (or, in RLE files, of the first coded row).
+/// No pixels are read and nothing is allocated.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageProbe(const char* filename, int* w, int* h, int* maxval, int64_t* offset) { ///
+  assert (filename != NULL);
+  assert (w != NULL && h != NULL && maxval != NULL && offset != NULL);
+  char format;
+  FILE* f = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  (hasExtension(filename, RLEEXT) ? readRLEHeader(f, w, h, maxval)
+                                  : readHeader(f, &format, w, h, maxval)) &&
+  check( (*offset = fileTell(f)) >= 0, "Seek failed" );
+
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+/// Load a raw PGM file by mapping it in memory.
+/// Like ImageLoad, but the pixel array is a private (copy-on-write)
+/// mapping of the file itself: no pixels are read or copied at load time.
+/// Pages are read on first access, and only pages that are modified get
+/// private copies.  The file should not be truncated while in use.
+/// Only 8-bit raw (P5) files can be mapped: for other formats, or where
+/// memory mapping is not supported, this is simply ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) { ///
+#ifdef HAVE_MMAP
+  int w, h;
+  int maxval;
+  char format;
+  FILE* f = NULL;
+  Image img = NULL;
+  struct stat st;
+  int64_t offset = 0;
+  void* map = MAP_FAILED;
+
+  if (hasExtension(filename, RLEEXT)) return ImageLoad(filename);  // must be decoded
+  if (!check( (f = fopen(filename, "rb")) != NULL, "Open failed" )) return NULL;
+  if (readHeader(f, &format, &w, &h, &maxval) && (format != '5' || maxval > PixMax)) {
+    fclose(f);
+    return ImageLoad(filename);  // pixels must be converted
+  }
+  rewind(f);
+
+  int success =
+  readHeader(f, &format, &w, &h, &maxval) &&
+  check( (offset = fileTell(f)) >= 0, "Seek failed" ) &&
+  check( fstat(fileno(f), &st) == 0, "Stat failed" ) &&
+  check( (uint64_t)st.st_size - (uint64_t)offset >= (uint64_t)w*h, "Reading pixels" ) &&
+  check( (uint64_t)st.st_size <= SIZE_MAX, "Mapping failed" ) &&
+  check( (map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE, fileno(f), 0)) != MAP_FAILED, "Mapping failed" ) &&
+  check( (img = malloc(sizeof(struct image))) != NULL, "Failed to allocate memory for image" );
+
+  if (success) {
+    // Pedir ao kernel leitura antecipada: as operações percorrem a imagem em sequência
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    madvise(map, (size_t)st.st_size, MADV_WILLNEED);
+    img->width = w;
+    img->height = h;
+    img->maxval = maxval;
+    img->map = map;
+    img->mapsize = (size_t)st.st_size;
+    img->pixel = (uint8*)map + offset; //os pixeis começam depois do cabeçalho
+    img->pool = NULL;
+    img->next = NULL;
+    img->cache = NULL;
+  } else {
+    errsave = errno;
+    if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);  // the mapping remains valid
+  return img;
+#else
+  return ImageLoad(filename);
+#endif
+}
+
 /// Save image to PGM file.
+/// If filename has extension ".rle", the image is saved in compact RLE
+/// format instead (see ImageLoad).
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
@@ -392,14 +1224,16 @@ int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
   int w = img->width;
   int h = img->height;
+  size_t n = (size_t)w*h;
   uint8 maxval = img->maxval;
   FILE* f = NULL;
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  (hasExtension(filename, RLEEXT) ? saveRLE(img, f) : (
   check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( fwrite(img->pixel, sizeof(uint8), n, f) == n, "Writing pixels failed" ) ));
+  PIXMEM += (unsigned long)n;  // count pixel memory accesses
 
   // Cleanup
   if (f != NULL) fclose(f);
@@ -407,6 +1241,246 @@ int ImageSave(Image img, const char* filename) { ///
 }
 
 
+/// Asynchronous save
+
+// Os ficheiros são escritos por uma thread de escrita, que processa os
+// pedidos por ordem de chegada.  Cada ficheiro é escrito num ficheiro
+// temporário, em blocos grandes e alinhados, e só no fim é renomeado para
+// o nome final: nunca fica um ficheiro parcial com esse nome.
+// A thread não usa check(): a causa de erro fica no pedido e é copiada para
+// errCause em ImageSaveWait, na thread de quem espera.
+
+// Size (and alignment) of the blocks written
+#define WRITEBLOCK (1 << 20)
+
+struct saveJob {
+  Image img;
+  char* filename;
+  int done;               // 1 when finished
+  int success;
+  const char* cause;      // error cause, if not success
+  int errnum;             // errno, if not success
+  struct saveJob* next;   // next in queue
+};
+
+#ifdef HAVE_PTHREAD
+
+static pthread_mutex_t saveLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t saveQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t saveDone = PTHREAD_COND_INITIALIZER;
+static struct saveJob* saveHead = NULL;   // queue of pending jobs
+static struct saveJob* saveTail = NULL;
+static int saveThreadRunning = 0;
+static unsigned saveSeq = 0;              // to name temporary files (writer thread only)
+
+// Write n bytes of buf to fd, retrying short writes.
+static int writeAll(int fd, const uint8* buf, size_t n) {
+  while (n > 0) {
+    ssize_t r = write(fd, buf, n);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    buf += r;
+    n -= (size_t)r;
+  }
+  return 1;
+}
+
+// Execute a save job (in the writer thread).
+static void runSaveJob(struct saveJob* job) {
+  Image img = job->img;
+  size_t n = (size_t)img->width * img->height;
+  size_t len = strlen(job->filename);
+  size_t tmplen = len + 32;
+  char* tmp = malloc(tmplen);
+  uint8* block = NULL;
+  int fd = -1;
+  job->success = 0;
+  job->cause = "Failed to allocate memory for writing";
+  if (tmp == NULL || posix_memalign((void**)&block, 4096, WRITEBLOCK) != 0) {
+    block = NULL;
+    goto done;
+  }
+  // Ficheiro temporário exclusivo, com permissões 0666 filtradas pela umask
+  // (como as de fopen), sem alterar a umask do processo
+  job->cause = "Open failed";
+  for (int tries = 0; fd < 0 && tries < 100; tries++) {
+    snprintf(tmp, tmplen, "%s.%ld.%u", job->filename, (long)getpid(), saveSeq++);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0 && errno != EEXIST) break;
+  }
+  if (fd < 0) { free(tmp); tmp = NULL; goto done; }
+
+  // Cabeçalho e pixeis são copiados para blocos alinhados de WRITEBLOCK bytes
+  job->cause = "Writing pixels failed";
+  size_t used = (size_t)snprintf((char*)block, WRITEBLOCK, "P5\n%d %d\n%u\n",
+                                 img->width, img->height, img->maxval);
+  for (size_t i = 0; i < n; ) {
+    size_t m = MIN(n - i, WRITEBLOCK - used);
+    memcpy(block + used, img->pixel + i, m);
+    used += m;
+    i += m;
+    if (used == WRITEBLOCK) {
+      if (!writeAll(fd, block, used)) goto done;
+      used = 0;
+    }
+  }
+  if (used > 0 && !writeAll(fd, block, used)) goto done;
+  if (close(fd) != 0) { fd = -1; goto done; }
+  fd = -1;
+  job->cause = "Rename failed";
+  if (rename(tmp, job->filename) != 0) goto done;
+  job->success = 1;
+  job->cause = "";
+
+done:
+  if (!job->success) {
+    job->errnum = errno;
+    if (fd >= 0) close(fd);
+    if (tmp != NULL) unlink(tmp);
+  }
+  free(block);
+  free(tmp);
+}
+
+// Writer thread: executes queued jobs, forever.
+static void* saveThread(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&saveLock);
+  for (;;) {
+    while (saveHead == NULL) pthread_cond_wait(&saveQueued, &saveLock);
+    struct saveJob* job = saveHead;
+    saveHead = job->next;
+    if (saveHead == NULL) saveTail = NULL;
+    pthread_mutex_unlock(&saveLock);
+    runSaveJob(job);
+    pthread_mutex_lock(&saveLock);
+    job->done = 1;
+    pthread_cond_broadcast(&saveDone);
+  }
+  return NULL;
+}
+
+#endif
+
+ImageSaveJob ImageSaveAsync(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  ImageSaveJob job = NULL;
+  if (!check( (job = calloc(1, sizeof(*job))) != NULL &&
+              (job->filename = malloc(strlen(filename) + 1)) != NULL,
+              "Failed to allocate memory for save" )) {
+    free(job);
+    return NULL;
+  }
+  strcpy(job->filename, filename);
+  job->img = img;
+#ifdef HAVE_PTHREAD
+  if (!hasExtension(filename, RLEEXT)) {
+    PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+    pthread_mutex_lock(&saveLock);
+    int ok = saveThreadRunning;
+    if (!ok) {
+      pthread_t thread;
+      ok = saveThreadRunning = (pthread_create(&thread, NULL, saveThread, NULL) == 0);
+      if (ok) pthread_detach(thread);
+    }
+    if (ok) {
+      if (saveTail != NULL) saveTail->next = job;
+      else saveHead = job;
+      saveTail = job;
+      pthread_cond_signal(&saveQueued);
+    }
+    pthread_mutex_unlock(&saveLock);
+    if (ok) return job;
+  }
+#endif
+  // Sem thread de escrita (ou formato RLE): grava já
+  job->success = ImageSave(img, filename);
+  job->cause = errCause;
+  job->errnum = errno;
+  job->done = 1;
+  return job;
+}
+
+int ImageSaveWait(ImageSaveJob* jobp) { ///
+  assert (jobp != NULL);
+  ImageSaveJob job = *jobp;
+  if (job == NULL) return 1;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&saveLock);
+  while (!job->done) pthread_cond_wait(&saveDone, &saveLock);
+  pthread_mutex_unlock(&saveLock);
+#endif
+  int success = job->success;
+  if (!success) {
+    errCause = (char*)job->cause;
+    errno = job->errnum;
+  }
+  free(job->filename);
+  free(job);
+  *jobp = NULL;
+  return success;
+}
+
+
+/// Multi-frame streams
+
+/// Read the next frame of a multi-frame raw PGM stream.
+///   f : stream open for reading (a file or a pipe, such as stdin).
+///   imgp : address of an Image variable, which may be NULL.
+/// If (*imgp) is an image with the same size as the frame, the frame is
+/// read into its pixel array, without any allocation.  Otherwise, (*imgp)
+/// is destroyed and replaced with a new image.
+/// Returns 1 if a frame was read, 0 at the end of the stream, and -1 on
+/// failure, with errno/errCause set accordingly.
+/// Only raw (P5) frames are accepted.
+int ImageReadFrame(FILE* f, Image* imgp) { ///
+  assert (f != NULL);
+  assert (imgp != NULL);
+  int w, h;
+  int maxval;
+  char format;
+
+  skipSpace(f);  // admite espaços entre imagens
+  int c = getc(f);
+  if (c == EOF) return 0;  // fim da sequência
+  ungetc(c, f);
+
+  int success =
+  readHeader(f, &format, &w, &h, &maxval) &&
+  check( format == '5', "Only raw PGM frames are accepted" );
+  if (!success) return -1;
+
+  Image img = *imgp;
+  if (img != NULL && (img->width != w || img->height != h || img->map != NULL))
+    ImageDestroy(imgp);
+  if (*imgp == NULL && (*imgp = newImage(w, h, (uint8)MIN(maxval, PixMax))) == NULL)
+    return -1;
+  img = *imgp;
+  img->maxval = MIN(maxval, PixMax);
+  markDirty(img, 0, 0, w, h);
+  if (!readPixels(f, img, format, maxval)) return -1;
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+  return 1;
+}
+
+/// Append image to a multi-frame raw PGM stream f.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWriteFrame(FILE* f, Image img) { ///
+  assert (f != NULL);
+  assert (img != NULL);
+  size_t n = (size_t)img->width * img->height;
+  int success =
+  check( fprintf(f, "P5\n%d %d\n%u\n", img->width, img->height, img->maxval) > 0, "Writing header failed" ) &&
+  check( fwrite(img->pixel, sizeof(uint8), n, f) == n, "Writing pixels failed" );
+  PIXMEM += (unsigned long)n;  // count pixel memory accesses
+  return success;
+}
+
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -438,8 +1512,20 @@ void ImageStats(Image img, uint8* min, uint8* max) {
   assert (img != NULL);
   *min = PixMax; //atribui o valor maximo possivel a min
   *max = 0; //atribui o valor minimo possivel a max
-  size_t area=img->width*img->height; //calcula a area da imagem, numero total de pixeis
-  for (int i = 0; i < area; i++) {
+  if (img->cache != NULL) {  //com cache, o mínimo e o máximo vêm do histograma
+    cacheRefresh(img);
+    const size_t* hist = img->cache->hist;
+    int v = 0;
+    while (v <= PixMax && hist[v] == 0) v++;
+    if (v > PixMax) return;  //imagem vazia
+    *min = (uint8)v;
+    v = PixMax;
+    while (hist[v] == 0) v--;
+    *max = (uint8)v;
+    return;
+  }
+  size_t area=(size_t)img->width*img->height; //calcula a area da imagem, numero total de pixeis
+  for (size_t i = 0; i < area; i++) {
     PIXMEM += 2;  // conta 2 acessos à memória
     if (img->pixel[i] < *min) {  //se o valor do pixel for menor que o valor minimo atual, o valor minimo atual passa a ser o valor do pixel
       *min = img->pixel[i];
@@ -450,6 +1536,21 @@ void ImageStats(Image img, uint8* min, uint8* max) {
   }
 }
 
+/// Histogram of levels: hist[v] is set to the number of pixels with level v.
+void ImageHistogram(Image img, size_t hist[]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  if (img->cache != NULL) {
+    cacheRefresh(img);
+    memcpy(hist, img->cache->hist, NLEVELS * sizeof(size_t));
+    return;
+  }
+  memset(hist, 0, NLEVELS * sizeof(size_t));
+  size_t area = (size_t)img->width*img->height;
+  for (size_t i = 0; i < area; i++) hist[img->pixel[i]]++;
+  PIXMEM += area;  // count pixel memory accesses
+}
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) { ///
   assert (img != NULL);
@@ -459,7 +1560,7 @@ int ImageValidPos(Image img, int x, int y) { ///
 /// Check if rectangular area (x,y,w,h) is completely inside img.
 int ImageValidRect(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
-  return (0 <= x && x+w <= img->width) && (0 <= y &&y+h <= img->height); 
+  return (0 <= x && (int64_t)x+w <= img->width) && (0 <= y && (int64_t)y+h <= img->height);
 }
 
 /// Pixel get & set operations
@@ -472,9 +1573,9 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
 // The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index = y*img->width + x;  //expressão para converter coordenadas (x,y) em indice linear
-  assert (0 <= index && index < img->width*img->height);
+static inline size_t G(Image img, int x, int y) {
+  size_t index = (size_t)y*img->width + x;  //expressão para converter coordenadas (x,y) em indice linear
+  assert (index < (size_t)img->width*img->height);
   return index;
 }
 
@@ -492,6 +1593,7 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///Atribui um valor d
   assert (ImageValidPos(img, x, y));  
   PIXMEM += 1; // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
+  markDirty(img, x, y, 1, 1);
 } 
 
 
@@ -508,8 +1610,9 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///Atribui um valor d
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) { ///
   assert (img != NULL);
-  size_t area=img->width*img->height; //area da imagem, numero total de pixeis
-  for (int i = 0; i < area; i++) {
+  markDirty(img, 0, 0, img->width, img->height);
+  size_t area=(size_t)img->width*img->height; //area da imagem, numero total de pixeis
+  for (size_t i = 0; i < area; i++) {
     PIXMEM += 2;  // conta o acesso a pixeis
     img->pixel[i] = PixMax - img->pixel[i]; //inverte o valor de intensidade cinzento de cada pixel
   }
@@ -520,8 +1623,9 @@ void ImageNegative(Image img) { ///
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) { ///
   assert (img != NULL);
-  size_t area=img->width*img->height; //area da imagem, numero total de pixeis
-  for (int i = 0; i < area; i++) {
+  markDirty(img, 0, 0, img->width, img->height);
+  size_t area=(size_t)img->width*img->height; //area da imagem, numero total de pixeis
+  for (size_t i = 0; i < area; i++) {
     PIXMEM ++;  // conta acesso a um pixel
     if (img->pixel[i] < thr) { //condições para o caso do valor de intensidade exceder os limites
       PIXMEM ++; 
@@ -540,8 +1644,9 @@ void ImageThreshold(Image img, uint8 thr) { ///
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) { ///
   assert (img != NULL);
-  size_t area=img->width*img->height; //area da imagem, numero total de pixeis
-  for (int i = 0; i < area; i++) {
+  markDirty(img, 0, 0, img->width, img->height);
+  size_t area=(size_t)img->width*img->height; //area da imagem, numero total de pixeis
+  for (size_t i = 0; i < area; i++) {
     PIXMEM++;  // conta acesso a um pixel
     if (img->pixel[i] * factor + 0.5 > img->maxval) {
       PIXMEM++;
@@ -554,6 +1659,58 @@ void ImageBrighten(Image img, double factor) { ///
   }
 }
 
+/// Map pixel levels through a lookup table.
+/// Replace each pixel level v by lut[v].  lut must have PixMax+1 entries.
+void ImageMapLevels(Image img, const uint8 lut[]) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+  markDirty(img, 0, 0, img->width, img->height);
+  size_t area = (size_t)img->width*img->height;
+  uint8* p = img->pixel;
+  for (size_t i = 0; i < area; i++) p[i] = lut[p[i]];
+  PIXMEM += 2*area;  // count pixel memory accesses (read and store)
+}
+
+/// Region-of-interest variants
+
+// As operações pontuais numa região são uma tabela aplicada linha a linha,
+// com os mesmos resultados que as versões para a imagem inteira.
+
+// Replace each level v in rectangle (x, y, w, h) of img by lut[v].
+static void mapRect(Image img, int x, int y, int w, int h, const uint8 lut[]) {
+  assert (img != NULL);
+  assert (w >= 0 && h >= 0 && ImageValidRect(img, x, y, w, h));
+  markDirty(img, x, y, w, h);
+  for (int j = 0; j < h; j++) {
+    uint8* p = img->pixel + G(img, x, y + j);
+    for (int i = 0; i < w; i++) p[i] = lut[p[i]];
+  }
+  PIXMEM += 2*(unsigned long)w*h;  // count pixel memory accesses (read and store)
+}
+
+void ImageNegativeRect(Image img, int x, int y, int w, int h) { ///
+  uint8 lut[NLEVELS];
+  for (int v = 0; v <= PixMax; v++) lut[v] = PixMax - v;
+  mapRect(img, x, y, w, h, lut);
+}
+
+void ImageThresholdRect(Image img, int x, int y, int w, int h, uint8 thr) { ///
+  assert (img != NULL);
+  uint8 lut[NLEVELS];
+  for (int v = 0; v <= PixMax; v++) lut[v] = (v < thr) ? 0 : img->maxval;
+  mapRect(img, x, y, w, h, lut);
+}
+
+void ImageBrightenRect(Image img, int x, int y, int w, int h, double factor) { ///
+  assert (img != NULL);
+  uint8 lut[NLEVELS];
+  for (int v = 0; v <= PixMax; v++) {
+    uint8 level = (uint8)v;   // mesma expressão que ImageBrighten
+    lut[v] = (level * factor + 0.5 > img->maxval) ? img->maxval : (uint8)(level * factor + 0.5);
+  }
+  mapRect(img, x, y, w, h, lut);
+}
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -577,14 +1734,19 @@ void ImageBrighten(Image img, double factor) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) { ///
   assert (img != NULL);
-  // Insert your code here!
-  Image rotatedImg = ImageCreate(img->height, img->width, img->maxval); // cria uma nova imagem, com os valores de largura e altura trocados
-  for (int i = 0; i < img->height; i++) {                               // isto é necessário para imagens não quadradas
-    for (int j = 0; j < img->width; j++) {
-      ImageSetPixel(rotatedImg, i, img->width - j -1, ImageGetPixel(img, j, i)); 
-    } //aplica-se a rotação de 90º anti-horario a cada pixel da imagem
-  }
-  return rotatedImg; //retorna a imagem
+  return ImageMaterialize(ImageViewRotate(ImageViewOf(img)));
+}
+
+/// Rotate an image by 180 degrees.
+/// Same as rotating it twice, without the intermediate image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) { ///
+  assert (img != NULL);
+  return ImageMaterialize(ImageViewRotate(ImageViewRotate(ImageViewOf(img))));
 }
 
 /// Mirror an image = flip left-right.
@@ -596,15 +1758,7 @@ Image ImageRotate(Image img) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) { ///
   assert (img != NULL);
-  // Insert your code here!
-  Image mirroredImg = ImageCreate(img->width, img->height, img->maxval); //cria uma nova imagem com as mesmas dimensões da anterior
-  for (int i = 0; i < img->height; i++) {
-    for (int j = 0; j < img->width; j++) {
-      ImageSetPixel(mirroredImg, j, i, ImageGetPixel(img, img->width - j - 1, i)); //para todos os pixeis, inverte as cordenadas do eixo do x
-                                                                                   //x=width-x-1
-    }
-  }
-  return mirroredImg; //retorna a nova imagem, com as alterações efetuadas
+  return ImageMaterialize(ImageViewMirror(ImageViewOf(img)));
 }
 
 /// Crop a rectangular subimage from img.
@@ -622,15 +1776,93 @@ Image ImageMirror(Image img) { ///
 Image ImageCrop(Image img, int x, int y, int w, int h) {
   assert(img != NULL);
   assert(ImageValidRect(img, x, y, w, h)); //verifica se as dimensões a serem cortadas pertencem completamente à àrea da imagem
+  return ImageMaterialize(ImageViewCrop(ImageViewOf(img), x, y, w, h));
+}
+
+/// Lazy geometric transformations
+
+/// The identity view of img.
+ImageView ImageViewOf(Image img) { ///
+  assert (img != NULL);
+  ImageView v = { .img = img, .x0 = 0, .y0 = 0, .xu = 1, .xv = 0, .yu = 0, .yv = 1,
+                  .width = img->width, .height = img->height };
+  return v;
+}
+
+/// View v rotated 90 degrees anti-clockwise (as ImageRotate).
+ImageView ImageViewRotate(ImageView v) { ///
+  // Pixel (i,j) of the result is pixel (width-1-j, i) of v
+  ImageView r = v;
+  r.x0 = v.x0 + v.xu*(v.width-1);
+  r.y0 = v.y0 + v.yu*(v.width-1);
+  r.xu = v.xv;  r.xv = -v.xu;
+  r.yu = v.yv;  r.yv = -v.yu;
+  r.width = v.height;
+  r.height = v.width;
+  return r;
+}
+
+/// View v mirrored left-right (as ImageMirror).
+ImageView ImageViewMirror(ImageView v) { ///
+  // Pixel (i,j) of the result is pixel (width-1-i, j) of v
+  ImageView r = v;
+  r.x0 = v.x0 + v.xu*(v.width-1);
+  r.y0 = v.y0 + v.yu*(v.width-1);
+  r.xu = -v.xu;
+  r.yu = -v.yu;
+  return r;
+}
+
+/// Check if rectangle (x, y, w, h) is inside view v.
+int ImageViewValidRect(ImageView v, int x, int y, int w, int h) { ///
+  return 0 <= x && 0 <= y && 0 <= w && 0 <= h &&
+         w <= v.width - x && h <= v.height - y;
+}
+
+/// Rectangle (x, y, w, h) of view v (as ImageCrop).
+ImageView ImageViewCrop(ImageView v, int x, int y, int w, int h) { ///
+  assert (ImageViewValidRect(v, x, y, w, h));
+  // Pixel (i,j) of the result is pixel (x+i, y+j) of v
+  ImageView r = v;
+  r.x0 = v.x0 + v.xu*x + v.xv*y;
+  r.y0 = v.y0 + v.yu*x + v.yv*y;
+  r.width = w;
+  r.height = h;
+  return r;
+}
 
-  Image croppedImg = ImageCreate(w, h, img->maxval); //cria uma nova imagem com as novas dimensões de largura e altura
-  for (int i = 0; i < h; i++) {
-    for (int j = 0; j < w; j++) {
-      ImageSetPixel(croppedImg, j, i, ImageGetPixel(img, x + j, y + i)); //atribui o valor de cinzento dos pixeis correspondentes à nova imagem
+// Side of the square tiles copied by ImageMaterialize
+#define TILE 64
+
+/// Copy the pixels of view v into a new image.
+Image ImageMaterialize(ImageView v) { ///
+  assert (v.img != NULL);
+  Image img = newImage(v.width, v.height, v.img->maxval);
+  if (img == NULL) return NULL;
+  ptrdiff_t sw = v.img->width;
+  // Offsets in the source pixel array of steps in i and in j
+  ptrdiff_t di = v.xu + v.yu*sw;
+  ptrdiff_t dj = v.xv + v.yv*sw;
+  const uint8* src = v.img->pixel + (v.x0 + v.y0*sw);
+  uint8* dst = img->pixel;
+  int w = v.width;
+  if (di == 1) {   // rows of the view are (parts of) rows of the source
+    for (int j = 0; j < v.height; j++) memcpy(dst + (size_t)j*w, src + j*dj, w);
+  } else {
+    for (int tj = 0; tj < v.height; tj += TILE) {
+      int ej = MIN(tj + TILE, v.height);
+      for (int ti = 0; ti < w; ti += TILE) {
+        int ei = MIN(ti + TILE, w);
+        for (int j = tj; j < ej; j++) {
+          const uint8* s = src + j*dj + ti*di;
+          uint8* d = dst + (size_t)j*w;
+          for (int i = ti; i < ei; i++, s += di) d[i] = *s;
+        }
+      }
     }
   }
-
-  return croppedImg; //retorna a nova imagem
+  PIXMEM += 2*(unsigned long)v.width*v.height;  // count pixel memory accesses
+  return img;
 }
 
 /// Operations on two images
@@ -684,11 +1916,15 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
   int max_width = x + img2->width - 1;
 
   // Variáveis para armazenar as somas de colunas e linhas
-  int sum_cols = 0;
-  int sum_rows = 0;
+  uint32_t sum_cols = 0;
+  uint32_t sum_rows = 0;
+
+  // As tabelas de soma só existem durante ImageLocateSubImage;
+  // fora dela compara-se diretamente pixel a pixel
+  int tables = (sumtable1 != NULL && sumtable2 != NULL);
 
   // Verifica as somas das colunas
-  for (int wid = 0; wid < img2->width; wid++) {
+  for (int wid = 0; tables && wid < img2->width; wid++) {
     ITER++;
     // Calcula a soma da coluna na imagem maior (img1)
     sum_cols = sumtable1[G(img1, x + wid, max_height)];
@@ -716,7 +1952,7 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
   }
 
   // Verifica as somas das linhas
-  for (int hei = 0; hei < img2->height; hei++) {
+  for (int hei = 0; tables && hei < img2->height; hei++) {
     ITER++;
     // Calcula a soma da linha da subimagem
     sum_rows = sumtable1[G(img1, max_width, y + hei)];
@@ -765,28 +2001,38 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// If the scratch tables cannot be allocated, returns -1.
 
 // Função para localizar uma subimagem em outra imagem
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
+  // Usa o workspace do contexto atual, ou um temporário
+  ImageWorkspace tmp = NULL;
+  ImageWorkspace ws = (currentContext != NULL) ? contextWorkspace() : (tmp = ImageWorkspaceCreate());
+  int found = (ws != NULL) ? ImageLocateSubImageWS(img1, px, py, img2, ws) : -1;
+  ImageWorkspaceDestroy(&tmp);
+  return found;
+}
+
+int ImageLocateSubImageWS(Image img1, int* px, int* py, Image img2, ImageWorkspace ws) { ///
   // Verifica se as imagens não são nulas
   assert(img1 != NULL);
   assert(img2 != NULL);
+  assert(ws != NULL);
 
-  // Chama as funções para calcular as tabelas de soma
-  calculateSumTables(img1, img2);
-  calculateSumTables_Quadrado(img1, img2);
+  // Obtém e calcula as tabelas de soma (as de img1 podem vir do seu cache)
+  if (!bindSumTables(ws, img1, img2)) return -1;
 
   // Obtém as somas finais das tabelas da img2
-  int sum2 = sumtable2[G(img2, img2->width - 1, img2->height - 1)];
-  int sumQ2 = sumtableQ2[G(img2, img2->width - 1, img2->height - 1)];
+  uint32_t sum2 = sumtable2[G(img2, img2->width - 1, img2->height - 1)];
+  uint32_t sumQ2 = sumtableQ2[G(img2, img2->width - 1, img2->height - 1)];
 
   // Itera sobre a imagem maior para procurar a subimagem
   for (int i = img2->height - 1; i < img1->height; i++) {
     for (int j = img2->width - 1; j < img1->width; j++) {
       ITER++;
       // Obtém as somas locais das tabelas da img1
-      int sum1 = sumtable1[G(img1, j, i)];
-      int sumQ1 = sumtableQ1[G(img1, j, i)];
+      uint32_t sum1 = sumtable1[G(img1, j, i)];
+      uint32_t sumQ1 = sumtableQ1[G(img1, j, i)];
 
       // Ajusta as somas subtraindo as partes que não são necessárias
       if (j - img2->width + 1 > 0) {
@@ -810,11 +2056,10 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
           // Usamos as duas sumtables (ao quadrado e normal), pois imagens com a mesma área podem ter tons de cinzento diferente, e assim garantimos que pelos menos os tons de cinzentos são todos iguais
           // Se as somas coincidirem, verifica se as sub-imagens correspondem
           if (ImageMatchSubImage(img1, j - img2->width + 1, i - img2->height + 1, img2)) {
-            // Se houver correspondência, atribui as coordenadas e liberta a memória
+            // Se houver correspondência, atribui as coordenadas e desliga as tabelas
             *px = j - img2->width + 1;
             *py = i - img2->height + 1;
-            freeSumTables();
-            freeSumTables_Quadrado();
+            bindSumTables(NULL, NULL, NULL);
             return 1; // Retorna 1 indicando correspondência encontrada
           }
         }
@@ -822,65 +2067,483 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
     }
   }
 
-  // Liberta a memória e retorna 0 se nenhuma correspondência for encontrada
-  freeSumTables();
-  freeSumTables_Quadrado();
+  // Desliga as tabelas e retorna 0 se nenhuma correspondência for encontrada
+  bindSumTables(NULL, NULL, NULL);
   return 0;
 }
 
 
+/// Image comparison
+
+// Compare rows a and b with n pixels: accumulates the number of
+// mismatches in *count, the maximum difference in *maxd, and returns the
+// sum of squared differences.  No branches, so that it can be vectorized.
+static uint64_t compareRow(const uint8* restrict a, const uint8* restrict b, int n,
+                           unsigned long* count, uint8* maxd) {
+  uint64_t sq = 0;
+  unsigned int c = 0;
+  uint8 m = *maxd;
+  for (int x = 0; x < n; x++) {
+    uint8 d = (uint8)(MAX(a[x], b[x]) - MIN(a[x], b[x]));
+    c += (d != 0);
+    m = MAX(m, d);
+    sq += (uint32_t)d * d;
+  }
+  *count += c;
+  *maxd = m;
+  return sq;
+}
+
+void ImageCompare(Image img1, int x, int y, Image img2, ImageCmp* cmp) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (cmp != NULL);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  int w = img2->width;
+  unsigned long count = 0;
+  uint8 maxd = 0;
+  uint64_t sq = 0;
+  for (int j = 0; j < img2->height; j++)
+    sq += compareRow(img1->pixel + (size_t)(y + j) * img1->width + x,
+                     img2->pixel + (size_t)j * w, w, &count, &maxd);
+  size_t area = (size_t)w * img2->height;
+  PIXMEM += 2 * (unsigned long)area;
+  cmp->mismatches = count;
+  cmp->maxerr = maxd;
+  cmp->mse = (area > 0) ? (double)sq / (double)area : 0.0;
+  cmp->psnr = (cmp->mse > 0.0)
+              ? 10.0 * log10((double)img1->maxval * img1->maxval / cmp->mse)
+              : INFINITY;
+}
+
+/// Frame differencing
+
+// Os ciclos sobre as linhas não têm saltos (max-min, comparação somada),
+// para o compilador os poder vetorizar.
+
+// Difference of row a with row b, n pixels, into a.
+// If thr > 0, a gets the mask (maxval where |a-b| >= thr); otherwise |a-b|.
+// Returns number of changed pixels in the row.
+static unsigned int diffRow(uint8* restrict a, const uint8* restrict b, int n,
+                            uint8 thr, uint8 maxval) {
+  unsigned int count = 0;
+  uint8 lim = (thr > 0) ? thr : 1;
+  if (thr > 0) {
+    uint8 mask = maxval;
+    for (int x = 0; x < n; x++) {
+      uint8 d = (uint8)(MAX(a[x], b[x]) - MIN(a[x], b[x]));
+      uint8 on = (uint8)(d >= lim);
+      count += on;
+      a[x] = (uint8)(-on) & mask;
+    }
+  } else {
+    for (int x = 0; x < n; x++) {
+      uint8 d = (uint8)(MAX(a[x], b[x]) - MIN(a[x], b[x]));
+      count += (d >= lim);
+      a[x] = d;
+    }
+  }
+  return count;
+}
+
+void ImageAbsDiff(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  int w = img1->width;
+  markDirty(img1, 0, 0, w, img1->height);
+  for (int y = 0; y < img1->height; y++)
+    diffRow(img1->pixel + (size_t)y * w, img2->pixel + (size_t)y * w, w, 0, 0);
+  PIXMEM += 3 * (unsigned long)w * img1->height;
+}
+
+unsigned long ImageDiffThreshold(Image img1, Image img2, uint8 thr,
+                                 int* px, int* py, int* pw, int* ph) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  int w = img1->width;
+  markDirty(img1, 0, 0, w, img1->height);
+  uint8 lim = (thr > 0) ? thr : 1;
+  unsigned long total = 0;
+  int x0 = w, y0 = -1, x1 = -1, y1 = -1;  // caixa envolvente
+  for (int y = 0; y < img1->height; y++) {
+    uint8* a = img1->pixel + (size_t)y * w;
+    const uint8* b = img2->pixel + (size_t)y * w;
+    unsigned int count = diffRow(a, b, w, thr, (uint8)img1->maxval);
+    if (count == 0) continue;
+    total += count;
+    if (y0 < 0) y0 = y;
+    y1 = y;
+    // Procura os extremos da linha, apenas fora da caixa já conhecida
+    // (após diffRow, a linha contém o resultado: alterado se >= lim, ou maxval)
+    uint8 on = (thr > 0) ? (uint8)img1->maxval : lim;
+    for (int x = 0; x < x0; x++)
+      if (a[x] >= on) { x0 = x; break; }
+    for (int x = w - 1; x > x1; x--)
+      if (a[x] >= on) { x1 = x; break; }
+  }
+  PIXMEM += 3 * (unsigned long)w * img1->height;
+  if (total == 0) {
+    *px = *py = *pw = *ph = 0;
+  } else {
+    *px = x0;
+    *py = y0;
+    *pw = x1 - x0 + 1;
+    *ph = y1 - y0 + 1;
+  }
+  return total;
+}
+
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
+/// Returns nonzero on success, or 0 if the scratch table cannot be allocated.
+
+int ImageBlur(Image img, int dx, int dy){
+  // Usa o workspace do contexto atual, ou um temporário
+  ImageWorkspace tmp = NULL;
+  ImageWorkspace ws = (currentContext != NULL) ? contextWorkspace() : (tmp = ImageWorkspaceCreate());
+  int ok = (ws != NULL) && ImageBlurWS(img, dx, dy, ws);
+  ImageWorkspaceDestroy(&tmp);
+  return ok;
+}
 
-void ImageBlur(Image img, int dx, int dy){ //Versão otimizada da função ImageBlur, através da tabela das somas
+int ImageBlurWS(Image img, int dx, int dy, ImageWorkspace ws) { ///
   assert(img!=NULL);
-  int *sumtable; //declaração da tabela de somas
-  sumtable = (int*) malloc(sizeof(uint8*)*img->width *img->height); //aloca memoria para a tabela de somas, que é igual ao numero de pixeis da imagem
-  for (int x=0; x< img->width; x++){ //itera-se por todos os pixeis da imagem e calcula-se a tabela de somas,
-    for (int y=0; y<img->height; y++){  //dependendo do valor de cinzento de cada pixel
-      ITER++;
-      sumtable[G(img,x,y)]=ImageGetPixel(img, x, y); //o valor de cada elemento da tabela das somas é igual ao valor de cinzento do pixel (x,y) correspondente
-      if (x>0 && y>0){                               //+ o valor do elemento (x-1,y) + o valor do elemento (x,y-1) - o valor do elemento (x-1,y-1).
-        sumtable[G(img,x,y)]-=sumtable[G(img,x-1,y-1)]; 
-      }
-      if (x > 0){
-        sumtable[G(img,x,y)]+=sumtable[G(img,x-1,y)];
-      }
-      if (y > 0){
-        sumtable[G(img,x,y)]+=sumtable[G(img,x,y-1)];
-      } //As condições anteriores são necessárias para evitar que sejam somados pixeis que não pertencem à imagem
+  return ImageBlurRectWS(img, 0, 0, img->width, img->height, dx, dy, ws);
+}
+
+int ImageBlurRect(Image img, int x, int y, int w, int h, int dx, int dy) { ///
+  // Usa o workspace do contexto atual, ou um temporário
+  ImageWorkspace tmp = NULL;
+  ImageWorkspace ws = (currentContext != NULL) ? contextWorkspace() : (tmp = ImageWorkspaceCreate());
+  int ok = (ws != NULL) && ImageBlurRectWS(img, x, y, w, h, dx, dy, ws);
+  ImageWorkspaceDestroy(&tmp);
+  return ok;
+}
+
+// Versão otimizada do blur, através da tabela das somas, calculada apenas
+// na região R = retângulo alargado pelas margens dx e dy (dentro da imagem).
+// A tabela tem uma linha e uma coluna de zeros a mais, no início, para
+// evitar casos especiais nas bordas: T[j][i] é a soma dos pixeis de R com
+// coordenadas relativas < (i, j).  As somas têm 64 bits (cada entrada
+// ocupa dois elementos da tabela do workspace): a soma de uma caixa grande
+// pode exceder 2^32.
+int ImageBlurRectWS(Image img, int x, int y, int w, int h, int dx, int dy,
+                    ImageWorkspace ws) { ///
+  assert (img != NULL);
+  assert (ws != NULL);
+  assert (w >= 0 && h >= 0 && ImageValidRect(img, x, y, w, h));
+  assert (dx >= 0 && dy >= 0);
+  if (w == 0 || h == 0) return 1;
+  markDirty(img, x, y, w, h);
+  int rx0 = (int)MAX((int64_t)x - dx, 0);   // região R
+  int ry0 = (int)MAX((int64_t)y - dy, 0);
+  int rx1 = (int)MIN((int64_t)x + w + dx, img->width);
+  int ry1 = (int)MIN((int64_t)y + h + dy, img->height);
+  size_t tw = (size_t)(rx1 - rx0) + 1;      // largura da tabela
+  size_t entries = tw * ((size_t)(ry1 - ry0) + 1);
+  if (!wsReserve(ws, WS_SUM1, 2 * entries)) return 0;
+  uint64_t* sumtable = (uint64_t*)ws->table[WS_SUM1];
+
+  // Tabela das somas de R, linha a linha, antes de alterar qualquer pixel
+  memset(sumtable, 0, tw * sizeof(uint64_t));
+  for (int j = ry0; j < ry1; j++) {
+    const uint8* row = img->pixel + G(img, rx0, j);
+    uint64_t* above = sumtable + (size_t)(j - ry0) * tw;
+    uint64_t* t = above + tw;
+    uint64_t rowsum = 0;
+    t[0] = 0;
+    for (size_t i = 0; i + 1 < tw; i++) {
+      rowsum += row[i];
+      t[i + 1] = above[i + 1] + rowsum;
     }
-  }//procede-se à aplicação do filtro de blur
-  for (int x=0; x< img->width; x++){
-    for (int y=0; y<img->height; y++){
-      ITER++;
-      int initial_x=MAX(x-dx,0); //evitar que as coordenadas da caixa do blur ultrapassem os limites da imagem
-      int initial_y=MAX(y-dy,0);
-      int x_end=MIN(x+dx, img->width-1); //evitar que as coordenadas da caixa do blur ultrapassem os limites da imagem
-      int y_end=MIN(y+dy, img->height-1);
-      int x_length=x_end-initial_x+1; //calcular o comprimento e a largura da caixa do blur
-      int y_length=y_end-initial_y+1;
-      int total=x_length*y_length; //numero de elementos da tabela de somas
-      //Devido à dimensão da caixa fazem-se as seguintes operações para calcular o blur
-      int blur=sumtable[G(img, x_end, y_end)]; //soma-se o valor do elemento (x,y) da tabela das somas
-      if (initial_x > 0){
-        blur-=sumtable[G(img,initial_x-1,y_end)]; //subtrai-se este elemento, pois este tem a soma do valor de pixeis fora dos limites do blur
-      }
-      if (initial_y > 0){
-        blur-=sumtable[G(img,x_end,initial_y-1)]; //subtrai-se este elemento, pois este tem a soma do valor de pixeis fora dos limites do blur
-      }
-      if (initial_x > 0 && initial_y > 0){ 
-        blur+=sumtable[G(img,initial_x-1,initial_y-1)]; //soma-se este elemento porque o valor dele é subtraido duas vezes nas condições anteriores
-      }
-      ImageSetPixel(img, x, y, (blur + total/2)/total); //atribui o valor de cinzento ao pixel, calculado através da expressão do blur
+  }
+
+  // Cada pixel do retângulo recebe a média da sua caixa, limitada à imagem
+  for (int j = y; j < y + h; j++) {
+    int by0 = MAX(j - dy, 0) - ry0;
+    int by1 = MIN(j + dy, img->height - 1) + 1 - ry0;
+    const uint64_t* t0 = sumtable + (size_t)by0 * tw;
+    const uint64_t* t1 = sumtable + (size_t)by1 * tw;
+    uint8* row = img->pixel + G(img, 0, j);
+    for (int i = x; i < x + w; i++) {
+      int bx0 = MAX(i - dx, 0) - rx0;
+      int bx1 = MIN(i + dx, img->width - 1) + 1 - rx0;
+      uint64_t blur = t1[bx1] - t1[bx0] - t0[bx1] + t0[bx0];
+      uint64_t total = (uint64_t)(bx1 - bx0) * (uint64_t)(by1 - by0);
+      row[i] = (uint8)((blur + total/2) / total);
+    }
+  }
+  unsigned long region = (unsigned long)(rx1 - rx0) * (ry1 - ry0);
+  PIXMEM += region + (unsigned long)w * h;  // count pixel memory accesses
+  ITER += region + (unsigned long)w * h;
+  return 1;
+}
+
+// Passagem de caixa (média móvel de raio r, limitada à linha) sobre nlines
+// linhas paralelas de len pixeis: o pixel k da linha l está em
+// src[l*lstep + k*step].  A mesma função serve as passagens horizontais
+// (uma linha, step 1) e verticais (todas as colunas de uma vez, step = largura,
+// para percorrer a memória linha a linha).  Cada linha tem um acumulador em
+// acc, que soma a janela atual: entra um pixel e sai outro por cada posição,
+// portanto o custo não depende de r.  Requer src != dst.
+static inline void boxPass(const uint8* src, uint8* dst, int len, size_t step,
+                    int nlines, size_t lstep, int r, uint32_t* acc) {
+  r = MIN(r, len - 1);   // uma janela maior que a linha cobre a linha toda
+  for (int l = 0; l < nlines; l++) acc[l] = 0;
+  for (int k = 0; k <= r; k++) {
+    const uint8* s = src + (size_t)k * step;
+    for (int l = 0; l < nlines; l++) acc[l] += s[l * lstep];
+  }
+  for (int k = 0; k < len; k++) {
+    double inv = 1.0 / (MIN(k + r, len - 1) - MAX(k - r, 0) + 1);  // 1/pixeis na janela
+    uint8* d = dst + (size_t)k * step;
+    for (int l = 0; l < nlines; l++) d[l * lstep] = (uint8)(acc[l] * inv + 0.5);
+    if (k + r + 1 < len) {
+      const uint8* s = src + (size_t)(k + r + 1) * step;
+      for (int l = 0; l < nlines; l++) acc[l] += s[l * lstep];
+    }
+    if (k - r >= 0) {
+      const uint8* s = src + (size_t)(k - r) * step;
+      for (int l = 0; l < nlines; l++) acc[l] -= s[l * lstep];
+    }
+  }
+}
+
+// Raios das 3 caixas cuja convolução aproxima uma gaussiana de desvio
+// padrão sigma: larguras ímpares wl ou wl+2, escolhidas para que a soma
+// das variâncias, (w^2-1)/12 cada, seja a mais próxima de sigma^2.
+static void gaussRadii(double sigma, int radius[3]) {
+  double var = sigma * sigma;
+  int wl = (int)floor(sqrt(12.0 * var / 3 + 1));
+  if (wl % 2 == 0) wl--;
+  int m = (int)lround((12.0 * var - 3.0 * wl * wl - 12.0 * wl - 9) / (-4.0 * wl - 4));
+  m = MAX(0, MIN(m, 3));   // número de caixas com largura wl
+  for (int i = 0; i < 3; i++) radius[i] = ((i < m) ? wl : wl + 2) / 2;
+}
+
+int ImageGaussianBlur(Image img, double sigma) { ///
+  // Usa o workspace do contexto atual, ou um temporário
+  ImageWorkspace tmp = NULL;
+  ImageWorkspace ws = (currentContext != NULL) ? contextWorkspace() : (tmp = ImageWorkspaceCreate());
+  int ok = (ws != NULL) && ImageGaussianBlurWS(img, sigma, ws);
+  ImageWorkspaceDestroy(&tmp);
+  return ok;
+}
+
+// Cada caixa é uma passagem horizontal, da imagem para a cópia em WS_PIX,
+// e uma vertical, de volta para a imagem.
+int ImageGaussianBlurWS(Image img, double sigma, ImageWorkspace ws) { ///
+  assert (img != NULL);
+  assert (ws != NULL);
+  assert (sigma >= 0.0);
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+  // Raios maiores que a imagem equivalem a raios iguais à imagem
+  sigma = MIN(sigma, 2.0 * MAX(w, h) + 1);
+  int radius[3];
+  gaussRadii(sigma, radius);
+  size_t area = (size_t)w * h;
+  if (!(wsReserve(ws, WS_PIX, area / sizeof(uint32_t) + 1) &&
+        wsReserve(ws, WS_LINE, (size_t)w))) return 0;
+  uint8* tmp = (uint8*)ws->table[WS_PIX];
+  uint32_t* acc = ws->table[WS_LINE];
+  markDirty(img, 0, 0, w, h);
+
+  for (int i = 0; i < 3; i++) {
+    if (radius[i] == 0) continue;   // caixa 1x1: identidade
+    for (int y = 0; y < h; y++) {
+      boxPass(img->pixel + G(img, 0, y), tmp + G(img, 0, y), w, 1, 1, 1, radius[i], acc);
     }
+    boxPass(tmp, img->pixel, h, (size_t)w, w, 1, radius[i], acc);
+    PIXMEM += 4 * (unsigned long)area;  // count pixel memory accesses
+    ITER += 2 * (unsigned long)area;
   }
-  free(sumtable);
-  sumtable=NULL;
+  return 1;
 }
 
 
+
+/// Streaming
+
+// Cada operação do pipeline é uma etapa que recebe linhas, por ordem, e
+// entrega linhas à etapa seguinte.  As operações pontuais entregam cada
+// linha logo que a recebem.  O blur guarda as últimas 2dy+2 linhas
+// (a sobreposição entre bandas) e as somas de cada coluna nessas linhas,
+// e entrega a linha y quando recebe a linha y+dy (ou no fim da imagem).
+
+// Estado de uma etapa do pipeline
+typedef struct {
+  StreamOp op;
+  uint8* ring;       // últimas linhas recebidas (só para o blur)
+  int nring;         // número de linhas em ring
+  uint64_t* colsum;  // somas das colunas, nas linhas da janela do blur
+  uint8* out;        // linha resultado do blur
+  int received;      // número de linhas recebidas
+  int sent;          // número de linhas entregues
+} StreamStage;
+
+// Estado do pipeline completo
+typedef struct {
+  int width, height, maxval;
+  int nstages;
+  StreamStage* stage;
+  uint8* band;       // banda de linhas de saída
+  int nband;         // capacidade da banda (linhas)
+  int filled;        // linhas na banda
+  FILE* out;
+  int ok;            // 0 depois de um erro de escrita
+} Stream;
+
+// Escreve as linhas acumuladas na banda de saída.
+static void streamFlushBand(Stream* s) {
+  size_t n = (size_t)s->filled * s->width;
+  if (s->ok && n > 0)
+    s->ok = check( fwrite(s->band, sizeof(uint8), n, s->out) == n, "Writing pixels failed" );
+  PIXMEM += (unsigned long)n;
+  s->filled = 0;
+}
+
+// Recebe uma linha na etapa i (i == nstages corresponde à saída).
+static void streamPush(Stream* s, int i, uint8* row);
+
+// Calcula e entrega a linha de saída y do blur da etapa i.
+static void streamBlurRow(Stream* s, int i, int y) {
+  StreamStage* st = &s->stage[i];
+  int w = s->width;
+  int dx = st->op.dx;
+  int dy = st->op.dy;
+  // As linhas são somadas ao serem recebidas; retira-se a que sai da janela [y-dy, y+dy]
+  if (y - dy - 1 >= 0) {
+    uint8* sub = st->ring + (size_t)((y - dy - 1) % st->nring) * w;
+    for (int x = 0; x < w; x++) st->colsum[x] -= sub[x];
+  }
+  int rows = MIN(y + dy, s->height - 1) - MAX(y - dy, 0) + 1;
+  // Janela deslizante na horizontal
+  uint64_t sum = 0;
+  for (int x = 0; x < MIN(dx, w); x++) sum += st->colsum[x];
+  for (int x = 0; x < w; x++) {
+    if (x + dx < w) sum += st->colsum[x + dx];
+    if (x - dx - 1 >= 0) sum -= st->colsum[x - dx - 1];
+    uint64_t total = (uint64_t)(MIN(x + dx, w - 1) - MAX(x - dx, 0) + 1) * rows;
+    st->out[x] = (uint8)((sum + total/2) / total);
+  }
+  PIXMEM += (unsigned long)w;
+  st->sent++;
+  streamPush(s, i + 1, st->out);
+}
+
+static void streamPush(Stream* s, int i, uint8* row) {
+  int w = s->width;
+  if (i == s->nstages) {  // saída
+    memcpy(s->band + (size_t)s->filled * w, row, (size_t)w);
+    if (++s->filled == s->nband) streamFlushBand(s);
+    return;
+  }
+  StreamStage* st = &s->stage[i];
+  switch (st->op.code) {
+  case STREAM_NEG:
+    for (int x = 0; x < w; x++) row[x] = PixMax - row[x];
+    break;
+  case STREAM_THR:
+    for (int x = 0; x < w; x++) row[x] = (row[x] < st->op.thr) ? 0 : s->maxval;
+    break;
+  case STREAM_BRI:
+    for (int x = 0; x < w; x++) {
+      double v = row[x] * st->op.factor + 0.5;
+      row[x] = (v > s->maxval) ? s->maxval : (uint8)v;
+    }
+    break;
+  case STREAM_BLUR:
+    memcpy(st->ring + (size_t)(st->received % st->nring) * w, row, (size_t)w);
+    for (int x = 0; x < w; x++) st->colsum[x] += row[x];
+    st->received++;
+    // A linha y pode ser calculada quando já se recebeu a linha y+dy
+    if (st->received == s->height)
+      while (st->sent < s->height) streamBlurRow(s, i, st->sent);
+    else if (st->received - 1 - st->op.dy >= 0)
+      streamBlurRow(s, i, st->received - 1 - st->op.dy);
+    return;
+  }
+  PIXMEM += 2 * (unsigned long)w;
+  streamPush(s, i + 1, row);
+}
+
+int ImageStream(const char* infile, const char* outfile, int band,
+                int nops, const StreamOp* ops) { ///
+  assert (band > 0);
+  assert (nops >= 0);
+  int w = 0, h = 0;
+  int maxval = 0;
+  char format;
+  FILE* in = NULL;
+  uint8* inband = NULL;
+  Stream s = { 0 };
+
+  int success =
+  check( (in = fopen(infile, "rb")) != NULL, "Open failed" ) &&
+  readHeader(in, &format, &w, &h, &maxval) &&
+  check( format == '5' && maxval <= PixMax, "Only 8-bit raw PGM files can be streamed" ) &&
+  check( (inband = malloc((size_t)band * w + 1)) != NULL, "Failed to allocate memory for band" ) &&
+  check( (s.band = malloc((size_t)band * w + 1)) != NULL, "Failed to allocate memory for band" ) &&
+  check( (s.stage = calloc((size_t)nops + 1, sizeof(StreamStage))) != NULL, "Failed to allocate memory for stream" );
+
+  s.width = w;
+  s.height = h;
+  s.maxval = maxval;
+  s.nband = band;
+  for (int i = 0; success && i < nops; i++) {
+    StreamStage* st = &s.stage[i];
+    st->op = ops[i];
+    s.nstages++;
+    if (ops[i].code != STREAM_BLUR) continue;
+    assert (ops[i].dx >= 0 && ops[i].dy >= 0);
+    st->nring = 2*MIN(ops[i].dy, h) + 2;  // janela de 2dy+1 linhas + 1 a retirar
+    success =
+    check( (st->ring = malloc((size_t)st->nring * w + 1)) != NULL, "Failed to allocate memory for blur" ) &&
+    check( (st->colsum = calloc((size_t)w + 1, sizeof(uint64_t))) != NULL, "Failed to allocate memory for blur" ) &&
+    check( (st->out = malloc((size_t)w + 1)) != NULL, "Failed to allocate memory for blur" );
+  }
+
+  success = success &&
+  check( (s.out = fopen(outfile, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(s.out, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" );
+  s.ok = success;
+
+  // Lê a imagem banda a banda e passa cada linha pelo pipeline
+  for (int y = 0; s.ok && y < h; y += band) {
+    int rows = MIN(band, h - y);
+    size_t n = (size_t)rows * w;
+    s.ok = check( fread(inband, sizeof(uint8), n, in) == n, "Reading pixels" );
+    PIXMEM += (unsigned long)n;
+    for (int r = 0; s.ok && r < rows; r++)
+      streamPush(&s, 0, inband + (size_t)r * w);
+  }
+  if (s.ok) streamFlushBand(&s);
+  success = s.ok;
+
+  // Cleanup
+  errsave = errno;
+  if (s.out != NULL && fclose(s.out) != 0 && success) {
+    success = check(0, "Writing pixels failed");
+    errsave = errno;
+  }
+  if (in != NULL) fclose(in);
+  for (int i = 0; s.stage != NULL && i < s.nstages; i++) {
+    free(s.stage[i].ring);
+    free(s.stage[i].colsum);
+    free(s.stage[i].out);
+  }
+  free(s.stage);
+  free(s.band);
+  free(inband);
+  errno = errsave;
+  return success;
+}
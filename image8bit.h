@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -39,6 +40,37 @@ char* ImageErrMsg() ;
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) ;
 
+/// Contexts
+
+/// A context holds the state of one user of the module: the error cause
+/// returned by ImageErrMsg, the instrumentation counters (NUMCOUNTERS of
+/// them) and the scratch workspace of ImageBlur and ImageLocateSubImage.
+/// Each thread uses the context it bound with ImageUseContext, or else
+/// the default context, whose counters are InstrCount (shared by all
+/// threads) and whose error cause is per thread.
+/// A context must not be bound by two threads at once.
+typedef struct imageContext* ImageContext;
+
+/// Create a new context, with zero counters.
+/// On success, a new context is returned.
+/// (The caller is responsible for destroying it with ImageContextDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageContext ImageContextCreate(void) ;
+
+/// Destroy the context pointed to by (*ctxp), unbinding it from the
+/// calling thread, if bound.
+/// If (*ctxp)==NULL, no operation is performed.
+/// Ensures: (*ctxp)==NULL.
+void ImageContextDestroy(ImageContext* ctxp) ;
+
+/// Make all module functions, when called from the calling thread, use
+/// context ctx (or the default context, if ctx is NULL).
+/// Returns the context used before (NULL for the default context).
+ImageContext ImageUseContext(ImageContext ctx) ;
+
+/// Return the array of counters of ctx (InstrCount, if ctx is NULL).
+unsigned long* ImageContextCounters(ImageContext ctx) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -58,21 +90,171 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Image pools
+
+/// A pool recycles the memory of destroyed images for new images of the
+/// same size (width and height), avoiding repeated allocation and page
+/// faults in loops that create and destroy same-size images.
+/// Pixel buffers from a pool are 64-byte aligned.
+/// Pools may be shared by threads.
+typedef struct imagePool* ImagePool;
+
+/// Pool statistics
+typedef struct {
+  unsigned long hits;       // images created with recycled memory
+  unsigned long misses;     // images created with new memory
+  unsigned long evictions;  // destroyed images freed because the pool was full
+  size_t cached;            // bytes of pixels in free images
+  long live;                // images from the pool not destroyed yet
+} ImagePoolStat;
+
+/// Create an image pool that keeps up to maxbytes of pixels in free
+/// images.  If hugepages is nonzero, large pixel buffers are allocated
+/// with transparent huge pages, where supported.
+/// On success, a new pool is returned.
+/// (The caller is responsible for destroying it with ImagePoolDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePool ImagePoolCreate(size_t maxbytes, int hugepages) ;
+
+/// Destroy the pool pointed to by (*poolp), freeing its free images.
+/// Images still in use are freed when destroyed.
+/// If (*poolp)==NULL, no operation is performed.
+/// Ensures: (*poolp)==NULL.
+void ImagePoolDestroy(ImagePool* poolp) ;
+
+/// Make ImageCreate and all functions that create images, when called
+/// from the calling thread, take images from pool (or allocate them
+/// normally, if pool is NULL).  ImageDestroy returns such images to pool.
+/// Returns the pool used before.
+ImagePool ImageUsePool(ImagePool pool) ;
+
+/// Get the statistics of pool into *stat.
+void ImagePoolGetStat(ImagePool pool, ImagePoolStat* stat) ;
+
+/// Workspaces
+
+/// A workspace holds the scratch tables of ImageBlurWS,
+/// ImageGaussianBlurWS and ImageLocateSubImageWS.  Its buffers grow as
+/// needed and are kept for later calls, so that repeated calls on images of
+/// the same size do not allocate memory.  A workspace must not be used by two threads at once.
+typedef struct imageWorkspace* ImageWorkspace;
+
+/// Create an empty workspace.
+/// On success, a new workspace is returned.
+/// (The caller is responsible for destroying it with ImageWorkspaceDestroy!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWorkspace ImageWorkspaceCreate(void) ;
+
+/// Destroy the workspace pointed to by (*wsp), freeing its buffers.
+/// If (*wsp)==NULL, no operation is performed.
+/// Ensures: (*wsp)==NULL.
+void ImageWorkspaceDestroy(ImageWorkspace* wsp) ;
+
+/// Derived data caches
+
+/// Keep data derived from the pixels of img with it: the sum tables
+/// used when img is searched by ImageLocateSubImage, and the histogram
+/// used by ImageStats and ImageHistogram.  Functions that modify pixels
+/// mark the changed rectangle, and the cache is brought up to date when
+/// next used, recomputing only the part affected by the changes.  So
+/// searching an image again after a small edit costs about as much as
+/// the edit (plus the search itself).
+/// The cache takes about 8 bytes per pixel, and is freed with the image.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageCacheEnable(Image img) ;
+
+/// Free the cache of img, if any.
+void ImageCacheDisable(Image img) ;
+
 /// PGM file operations
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+/// Load a PGM file.
+/// Raw (P5) and plain (P2) PGM files are accepted, with maxval up to 65535.
+/// Levels of files with maxval > PixMax are scaled down to [0, PixMax]
+/// and the image gets maxval PixMax.
+/// Files with extension ".rle" are read in a native compact format
+/// instead, where each row is stored raw or coded with run-length
+/// (PackBits) or delta+run-length coding, whichever is smaller.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Probe an image file header.
+/// Parses only the header of a PGM (or RLE) file, as ImageLoad would,
+/// and sets (*w, *h) to its size, *maxval to its maxval in the file
+/// (which may exceed PixMax), and *offset to the file position of the
+/// first pixel (or, in RLE files, of the first coded row).
+/// No pixels are read and nothing is allocated.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageProbe(const char* filename, int* w, int* h, int* maxval, int64_t* offset) ;
+
+/// Load a raw PGM file by mapping it in memory.
+/// Like ImageLoad, but the pixel array is a private (copy-on-write)
+/// mapping of the file itself: no pixels are read or copied at load time.
+/// Pages are read on first access, and only pages that are modified get
+/// private copies.  The file should not be truncated while in use.
+/// Only 8-bit raw (P5) files can be mapped: for other formats, or where
+/// memory mapping is not supported, this is simply ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
 /// Save image to PGM file.
+/// If filename has extension ".rle", the image is saved in compact RLE
+/// format instead (see ImageLoad).
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Asynchronous save
+
+/// Handle of a pending save operation
+typedef struct saveJob* ImageSaveJob;
+
+/// Save image to PGM file in the background.
+/// The file is written by a writer thread, to a temporary file that is
+/// renamed to filename when complete, so no partial file is ever left with
+/// that name.  Saves are executed in the order they were requested.
+/// Requires: img must not be modified or destroyed until ImageSaveWait
+/// returns for the returned job.
+/// Files with extension ".rle" (or all files, if threads are not
+/// supported) are saved before returning, as in ImageSave.
+/// On success, returns a job handle, which must be passed to ImageSaveWait.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageSaveJob ImageSaveAsync(Image img, const char* filename) ;
+
+/// Wait for the save operation (*jobp) to complete, and release it.
+/// If (*jobp)==NULL, no operation is performed and nonzero is returned.
+/// Ensures: (*jobp)==NULL.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageSaveWait(ImageSaveJob* jobp) ;
+
+/// Multi-frame streams
+
+/// A PGM stream may contain several images (frames) concatenated.
+
+/// Read the next frame of a multi-frame raw PGM stream.
+///   f : stream open for reading (a file or a pipe, such as stdin).
+///   imgp : address of an Image variable, which may be NULL.
+/// If (*imgp) is an image with the same size as the frame, the frame is
+/// read into its pixel array, without any allocation.  Otherwise, (*imgp)
+/// is destroyed and replaced with a new image.
+/// Returns 1 if a frame was read, 0 at the end of the stream, and -1 on
+/// failure, with errno/errCause set accordingly.
+/// Only raw (P5) frames are accepted.
+int ImageReadFrame(FILE* f, Image* imgp) ;
+
+/// Append image to a multi-frame raw PGM stream f.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWriteFrame(FILE* f, Image img) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -93,6 +275,10 @@ int ImageMaxval(Image img) ;
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Histogram of levels.
+/// Sets hist[v] to the number of pixels with level v, for v in [0, PixMax].
+void ImageHistogram(Image img, size_t hist[]) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -135,6 +321,20 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Map pixel levels through a lookup table.
+/// Replace each pixel level v by lut[v].  lut must have PixMax+1 entries.
+/// Any sequence of the point operations above is equivalent to a single
+/// lookup table, computed for the image maxval.
+void ImageMapLevels(Image img, const uint8 lut[]) ;
+
+/// Region-of-interest variants.
+/// Same as the operations above, but only the pixels of rectangle
+/// (x, y, w, h) are changed, and only they are visited.
+/// Requires: the rectangle must be inside img, with w, h >= 0.
+void ImageNegativeRect(Image img, int x, int y, int w, int h) ;
+void ImageThresholdRect(Image img, int x, int y, int w, int h, uint8 thr) ;
+void ImageBrightenRect(Image img, int x, int y, int w, int h, double factor) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +355,15 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image by 180 degrees.
+/// Same as rotating it twice, without the intermediate image.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -178,6 +387,48 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Lazy geometric transformations
+
+/// A view of an image through a geometric transformation: any combination
+/// of rotations, mirrors and crops.  It is an element of the dihedral
+/// group of the square (8 orientations) plus a rectangle: pixel (i,j) of
+/// the view is pixel (x0 + xu*i + xv*j, y0 + yu*i + yv*j) of img, where
+/// (xu, xv, yu, yv) is a rotation/reflection matrix (entries 0, 1 or -1).
+/// Views are values that compose in O(1), without touching pixels, so a
+/// chain of transformations costs a single copy when materialized.
+/// A view refers to img, which must not be destroyed while it is in use.
+/// (ImageRotate, ImageMirror, ImageCrop and ImageRotate180 are the
+/// materialization of single-step views.)
+typedef struct {
+  Image img;            // underlying image
+  int x0, y0;           // position in img of view pixel (0,0)
+  int xu, xv, yu, yv;   // orientation
+  int width, height;    // size of the view
+} ImageView;
+
+/// The identity view of img.
+ImageView ImageViewOf(Image img) ;
+
+/// View v rotated 90 degrees anti-clockwise (as ImageRotate).
+ImageView ImageViewRotate(ImageView v) ;
+
+/// View v mirrored left-right (as ImageMirror).
+ImageView ImageViewMirror(ImageView v) ;
+
+/// Rectangle (x, y, w, h) of view v (as ImageCrop).
+/// Requires: the rectangle must be inside the view.
+ImageView ImageViewCrop(ImageView v, int x, int y, int w, int h) ;
+
+/// Check if rectangle (x, y, w, h) is inside view v.
+int ImageViewValidRect(ImageView v, int x, int y, int w, int h) ;
+
+/// Copy the pixels of view v into a new image (in tiles, so that reading
+/// columns of img, as in rotations, stays cache friendly).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMaterialize(ImageView v) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -203,14 +454,135 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// If the scratch tables cannot be allocated, returns -1 and
+/// errno/errCause are set accordingly.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Like ImageLocateSubImage, but with the scratch tables in workspace ws.
+/// If the workspace cannot grow, returns -1 and errno/errCause are set
+/// accordingly.
+int ImageLocateSubImageWS(Image img1, int* px, int* py, Image img2, ImageWorkspace ws) ;
+
+/// Image comparison
+
+/// Metrics of the difference between two images
+typedef struct {
+  unsigned long mismatches;  // number of different pixels
+  int maxerr;                // maximum absolute difference
+  double mse;                // mean squared error
+  double psnr;               // peak signal-to-noise ratio (dB), INFINITY if equal
+} ImageCmp;
+
+/// Compare an image to a subimage of another image.
+/// Compares img2 to the subimage of img1 at position (x, y) with the same
+/// size as img2 (use x = y = 0 to compare two images of the same size),
+/// and fills in *cmp.  The PSNR uses the maxval of img1 as peak level.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void ImageCompare(Image img1, int x, int y, Image img2, ImageCmp* cmp) ;
+
+/// Frame differencing
+
+/// Absolute difference of two images.
+/// Each pixel of img1 is replaced by |img1 - img2| at the same position.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img1 and img2 have the same size.
+void ImageAbsDiff(Image img1, Image img2) ;
+
+/// Motion mask of two images.
+/// Each pixel of img1 is set to maxval if |img1 - img2| >= thr at the same
+/// position (a changed pixel), and to 0 otherwise.
+/// If thr == 0, no threshold is applied: img1 gets |img1 - img2|, as in
+/// ImageAbsDiff, and changed pixels are those with a nonzero difference.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: img1 and img2 have the same size.
+/// Returns the number of changed pixels, and sets (*px, *py, *pw, *ph) to
+/// their bounding box (or to 0,0,0,0 if there are none).
+unsigned long ImageDiffThreshold(Image img1, Image img2, uint8 thr,
+                                 int* px, int* py, int* pw, int* ph) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// On success, returns nonzero.
+/// If the scratch memory cannot be allocated, returns 0, the image is
+/// unchanged, and errno/errCause are set accordingly.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Like ImageBlur, but with the scratch table in workspace ws.
+/// On success, returns nonzero.
+/// If the workspace cannot grow, returns 0, the image is unchanged, and
+/// errno/errCause are set accordingly.
+int ImageBlurWS(Image img, int dx, int dy, ImageWorkspace ws) ;
+
+/// Blur only the pixels of rectangle (x, y, w, h) of img.
+/// The mean filter reads pixels around the rectangle, up to dx and dy
+/// pixels away, as ImageBlur would, so the rectangle gets the same levels
+/// as after blurring the whole image.  Time and scratch memory are
+/// proportional to the rectangle expanded by those margins.
+/// Requires: the rectangle must be inside img, with w, h >= 0, and
+/// dx, dy >= 0.
+/// On success, returns nonzero.
+/// If the scratch memory cannot be allocated, returns 0, the image is
+/// unchanged, and errno/errCause are set accordingly.
+int ImageBlurRect(Image img, int x, int y, int w, int h, int dx, int dy) ;
+
+/// Like ImageBlurRect, but with the scratch table in workspace ws.
+/// On success, returns nonzero.
+/// If the workspace cannot grow, returns 0, the image is unchanged, and
+/// errno/errCause are set accordingly.
+int ImageBlurRectWS(Image img, int x, int y, int w, int h, int dx, int dy,
+                    ImageWorkspace ws) ;
+
+/// Blur an image with an approximate Gaussian filter of standard
+/// deviation sigma (in pixels).
+/// The filter is applied as 3 mean filters in a row, each one as a
+/// horizontal and a vertical pass, with radii chosen to match sigma.
+/// Near the borders, means are taken over the pixels inside the image, as
+/// in ImageBlur.  Time is proportional to the image area, whatever sigma.
+/// Requires: sigma >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// If the scratch memory cannot be allocated, returns 0, the image is
+/// unchanged, and errno/errCause are set accordingly.
+int ImageGaussianBlur(Image img, double sigma) ;
+
+/// Like ImageGaussianBlur, but with the scratch buffers in workspace ws.
+/// On success, returns nonzero.
+/// If the workspace cannot grow, returns 0, the image is unchanged, and
+/// errno/errCause are set accordingly.
+int ImageGaussianBlurWS(Image img, double sigma, ImageWorkspace ws) ;
+
+/// Streaming
+
+/// These functions process PGM files that need not fit in memory.
+/// The input is read in bands of rows, each row goes through a pipeline of
+/// operations and results are written to the output file as they are
+/// produced.  Memory use is proportional to the image width (and band
+/// height and blur radius), but not to the image height.
+
+/// Operations that may be applied in a stream.
+typedef enum { STREAM_NEG, STREAM_THR, STREAM_BRI, STREAM_BLUR } StreamOpCode;
+
+/// An operation in a stream pipeline, with its operands.
+typedef struct {
+  StreamOpCode code;
+  uint8 thr;       // for STREAM_THR
+  double factor;   // for STREAM_BRI
+  int dx, dy;      // for STREAM_BLUR
+} StreamOp;
+
+/// Apply a pipeline of ops[0..nops-1] to PGM file infile, writing outfile.
+/// Results are the same as applying ImageNegative, ImageThreshold,
+/// ImageBrighten and ImageBlur, in sequence, to the whole image.
+///   band : number of rows read and written at a time.
+/// Requires: band > 0, nops >= 0, blur displacements non-negative.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageStream(const char* infile, const char* outfile, int band,
+                int nops, const StreamOp* ops) ;
 
 #endif
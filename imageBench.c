@@ -0,0 +1,299 @@
+// imageBench - Benchmark suite for the image8bit module.
+//
+// This program uses the image8bit module (by João Manuel Rodrigues and the
+// student authors listed in image8bit.c), a programming project for the
+// course AED, DETI / UA.PT, but was written separately from it.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to its authors.
+//
+// Authors: the contributors who committed it (see "git log imageBench.c").
+// 2026
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "error.h"
+#include <assert.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [-r REPS] [-s SIZE,...] [-o FILE] [-c FILE] [-t THRESHOLD]\n"
+    "  Time every image8bit operation on deterministic synthetic images.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -r REPS         Repetitions per measurement (default 5)\n"
+    "  -s SIZE,...     Sizes of the (square) images (default 256,512,1024,2048)\n"
+    "  -o FILE         Save results to baseline FILE\n"
+    "  -c FILE         Compare results against baseline FILE\n"
+    "  -t THRESHOLD    Relative slowdown of the median considered a regression\n"
+    "                  (default 0.10, i.e. 10%)\n"
+    "\n"
+    "IMAGES:\n"
+    "  noise           Pseudo-random levels (fixed seed)\n"
+    "  gradient        Diagonal gradient\n"
+    "  flat            Constant level\n"
+    "  tiles           Repetition of a small noise tile\n"
+    "  Templates for locate are crops of the image; in the near-match case\n"
+    "  the last pixel of the template is changed, so every candidate position\n"
+    "  must be checked almost to the end.\n"
+    "\n"
+    "Exits with status 1 if a regression was found.\n"
+    ;
+
+#define MAXSIZES 16
+#define MAXREPS 1000
+#define MAXRESULTS 4096
+#define TILE 16
+
+// Kinds of synthetic images
+enum { NOISE, GRADIENT, FLAT, TILES, NUMKINDS };
+static const char* kindName[NUMKINDS] = { "noise", "gradient", "flat", "tiles" };
+
+// Result of one measurement
+typedef struct {
+  char op[16];
+  char kind[16];
+  int size;
+  double min, median, p99;  // wall-clock times in seconds
+} Result;
+
+static Result results[MAXRESULTS];
+static int nresults = 0;
+
+// Deterministic pseudo-random generator (xorshift32), so that every run
+// uses exactly the same images.
+static unsigned int seed;
+static unsigned int xorshift(void) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+// Generate a synthetic image of the given kind.
+static Image Generate(int kind, int w, int h) {
+  Image img = ImageCreate(w, h, PixMax);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  uint8 tile[TILE][TILE];
+  seed = 2463534242u;
+  for (int y = 0; y < TILE; y++)
+    for (int x = 0; x < TILE; x++)
+      tile[y][x] = (uint8)(xorshift() % (PixMax + 1));
+  seed = 88172645u;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 level;
+      switch (kind) {
+      case NOISE:    level = (uint8)(xorshift() % (PixMax + 1)); break;
+      case GRADIENT: level = (uint8)((long)(x + y) * PixMax / (w + h > 2 ? w + h - 2 : 1)); break;
+      case FLAT:     level = 100; break;
+      default:       level = tile[y % TILE][x % TILE]; break;
+      }
+      ImageSetPixel(img, x, y, level);
+    }
+  }
+  return img;
+}
+
+// Compare doubles, for qsort.
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Store statistics of the times t[0..reps-1] (which are sorted).
+static void Record(const char* op, int kind, int size, double* t, int reps) {
+  if (nresults >= MAXRESULTS) return;
+  qsort(t, reps, sizeof(double), cmpDouble);
+  Result* r = &results[nresults++];
+  snprintf(r->op, sizeof(r->op), "%s", op);
+  snprintf(r->kind, sizeof(r->kind), "%s", kindName[kind]);
+  r->size = size;
+  r->min = t[0];
+  r->median = (reps % 2 == 1) ? t[reps/2] : (t[reps/2 - 1] + t[reps/2]) / 2.0;
+  int k = (99 * reps + 99) / 100;   // nearest-rank percentile
+  r->p99 = t[(k > 0 ? k : 1) - 1];
+  printf("%-8s %-9s %6d %12.6f %12.6f %12.6f %10.1f\n", r->op, r->kind,
+         r->size, r->min, r->median, r->p99,
+         r->median > 0.0 ? (double)size*size / r->median * 1.0e-6 : 0.0);
+  fflush(stdout);
+}
+
+// Time statement STMT reps times, with SETUP/CLEANUP run untimed around
+// each repetition, and record the result.
+#define BENCH(op, kind, size, SETUP, STMT, CLEANUP) do {   \
+    double t[MAXREPS];                                      \
+    for (int r = 0; r < reps; r++) {                        \
+      SETUP;                                                \
+      double t0 = wall_time();                              \
+      STMT;                                                 \
+      t[r] = wall_time() - t0;                              \
+      CLEANUP;                                              \
+    }                                                       \
+    Record(op, kind, size, t, reps);                        \
+  } while (0)
+
+// Run all benchmarks on an image of the given kind and size.
+static void BenchImage(int kind, int size, int reps, const char* tmpfile) {
+  Image img = Generate(kind, size, size);
+  Image work = NULL;
+  Image tmp = NULL;
+  uint8 min, max;
+  int px, py;
+  int s = size / 4 > 0 ? size / 4 : 1;   // size of templates and crops
+
+  // Operations that do not modify the image
+  BENCH("stats", kind, size, , ImageStats(img, &min, &max), );
+  BENCH("save", kind, size, ,
+        if (!ImageSave(img, tmpfile)) error(2, errno, "Saving %s: %s", tmpfile, ImageErrMsg()), );
+  BENCH("load", kind, size, , tmp = ImageLoad(tmpfile),
+        if (tmp == NULL) error(2, errno, "Loading %s: %s", tmpfile, ImageErrMsg());
+        ImageDestroy(&tmp));
+  BENCH("rotate", kind, size, , tmp = ImageRotate(img), ImageDestroy(&tmp));
+  BENCH("mirror", kind, size, , tmp = ImageMirror(img), ImageDestroy(&tmp));
+  BENCH("crop", kind, size, , tmp = ImageCrop(img, s, s, 2*s, 2*s), ImageDestroy(&tmp));
+
+  // In-place operations work on a fresh copy of the image
+#define COPY work = ImageCrop(img, 0, 0, size, size)
+  BENCH("neg", kind, size, COPY, ImageNegative(work), ImageDestroy(&work));
+  BENCH("thr", kind, size, COPY, ImageThreshold(work, 128), ImageDestroy(&work));
+  BENCH("bri", kind, size, COPY, ImageBrighten(work, 1.3), ImageDestroy(&work));
+  BENCH("blur", kind, size, COPY,
+        if (!ImageBlur(work, 7, 7)) error(2, errno, "Blurring: %s", ImageErrMsg()),
+        ImageDestroy(&work));
+  BENCH("gauss", kind, size, COPY,
+        if (!ImageGaussianBlur(work, 4.0)) error(2, errno, "Blurring: %s", ImageErrMsg()),
+        ImageDestroy(&work));
+
+  // Operations on two images
+  Image templ = ImageCrop(img, size - s, size - s, s, s);  // found at the end
+  BENCH("paste", kind, size, COPY, ImagePaste(work, s, s, templ), ImageDestroy(&work));
+  BENCH("blend", kind, size, COPY, ImageBlend(work, s, s, templ, 0.33), ImageDestroy(&work));
+#undef COPY
+  BENCH("match", kind, size, , ImageMatchSubImage(img, size - s, size - s, templ), );
+  BENCH("locate", kind, size, ,
+        if (ImageLocateSubImage(img, &px, &py, templ) != 1) error(2, errno, "Locating: %s", ImageErrMsg()), );
+  // Near-match template: differs only in its last pixel
+  uint8 last = ImageGetPixel(templ, s - 1, s - 1);
+  ImageSetPixel(templ, s - 1, s - 1, (uint8)(last ^ 1));
+  BENCH("locnear", kind, size, ,
+        if (ImageLocateSubImage(img, &px, &py, templ) < 0) error(2, errno, "Locating: %s", ImageErrMsg()), );
+  ImageDestroy(&templ);
+
+  ImageDestroy(&img);
+}
+
+// Load baseline file into array b.  Returns number of entries.
+static int LoadBaseline(const char* filename, Result* b, int max) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) error(3, errno, "Opening baseline %s", filename);
+  int n = 0;
+  char line[256];
+  while (n < max && fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#') continue;
+    Result* r = &b[n];
+    if (sscanf(line, "%15s %15s %d %lf %lf %lf", r->op, r->kind, &r->size,
+               &r->min, &r->median, &r->p99) == 6) n++;
+  }
+  fclose(f);
+  return n;
+}
+
+// Save results to baseline file.
+static void SaveBaseline(const char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) error(3, errno, "Creating baseline %s", filename);
+  fprintf(f, "# op kind size min median p99\n");
+  for (int i = 0; i < nresults; i++) {
+    Result* r = &results[i];
+    fprintf(f, "%s %s %d %.9f %.9f %.9f\n", r->op, r->kind, r->size,
+            r->min, r->median, r->p99);
+  }
+  if (fclose(f) != 0) error(3, errno, "Writing baseline %s", filename);
+}
+
+// Compare results to baseline.  Returns number of regressions.
+static int CompareBaseline(const char* filename, double threshold) {
+  static Result base[MAXRESULTS];
+  int nbase = LoadBaseline(filename, base, MAXRESULTS);
+  int regressions = 0;
+  printf("\n#%-7s %-9s %6s %12s %12s %8s\n", "op", "kind", "size",
+         "base", "median", "ratio");
+  for (int i = 0; i < nresults; i++) {
+    Result* r = &results[i];
+    for (int j = 0; j < nbase; j++) {
+      Result* b = &base[j];
+      if (b->size != r->size || strcmp(b->op, r->op) != 0 ||
+          strcmp(b->kind, r->kind) != 0) continue;
+      double ratio = b->median > 0.0 ? r->median / b->median : 1.0;
+      int bad = ratio > 1.0 + threshold;
+      regressions += bad;
+      printf("%-8s %-9s %6d %12.6f %12.6f %8.3f%s\n", r->op, r->kind, r->size,
+             b->median, r->median, ratio, bad ? "  REGRESSION" : "");
+      break;
+    }
+  }
+  printf("# %d regression(s) above %.1f%%\n", regressions, 100.0 * threshold);
+  return regressions;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+
+  int reps = 5;
+  int sizes[MAXSIZES] = { 256, 512, 1024, 2048 };
+  int nsizes = 4;
+  const char* outfile = NULL;
+  const char* basefile = NULL;
+  double threshold = 0.10;
+
+  for (int k = 1; k < ac; k++) {
+    if (k + 1 >= ac) error(1, 0, "Missing operand for %s\n%s", av[k], USAGE);
+    if (strcmp(av[k], "-r") == 0) {
+      if (sscanf(av[++k], "%d", &reps) != 1 || reps < 1 || reps > MAXREPS)
+        error(1, 0, "Invalid repetitions: %s", av[k]);
+    } else if (strcmp(av[k], "-s") == 0) {
+      char* p = av[++k];
+      nsizes = 0;
+      while (nsizes < MAXSIZES && *p != '\0') {
+        char* end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < 4 || v > 65535) error(1, 0, "Invalid size: %s", av[k]);
+        sizes[nsizes++] = (int)v;
+        p = (*end == ',') ? end + 1 : end;
+      }
+    } else if (strcmp(av[k], "-o") == 0) {
+      outfile = av[++k];
+    } else if (strcmp(av[k], "-c") == 0) {
+      basefile = av[++k];
+    } else if (strcmp(av[k], "-t") == 0) {
+      if (sscanf(av[++k], "%lf", &threshold) != 1 || threshold < 0.0)
+        error(1, 0, "Invalid threshold: %s", av[k]);
+    } else {
+      error(1, 0, "Invalid option: %s\n%s", av[k], USAGE);
+    }
+  }
+
+  ImageInit();
+
+  // Scratch file for load/save benchmarks
+  char tmpfile[64];
+  snprintf(tmpfile, sizeof(tmpfile), "imageBench-%ld.pgm", (long)wall_time());
+
+  printf("#%-7s %-9s %6s %12s %12s %12s %10s\n", "op", "kind", "size",
+         "min", "median", "p99", "MB/s");
+  for (int i = 0; i < nsizes; i++)
+    for (int kind = 0; kind < NUMKINDS; kind++)
+      BenchImage(kind, sizes[i], reps, tmpfile);
+  remove(tmpfile);
+
+  int regressions = 0;
+  if (basefile != NULL) regressions = CompareBaseline(basefile, threshold);
+  if (outfile != NULL) SaveBaseline(outfile);
+  return regressions > 0 ? 1 : 0;
+}
@@ -72,7 +72,7 @@ int main(int argc, char* argv[]) {
     Image nb1 = ImageCrop(cp1, 0, 0, ImageWidth(img1), ImageHeight(img1));//74
     printf("\n# Otimizado:\n # BLUR image (size: %d - window %dx%d) com dx = %d e dy = %d\n", n,ImageWidth(img1),ImageHeight(img1),10,10);
     InstrReset();
-    ImageBlur(nb1,10,10);
+    if (!ImageBlur(nb1,10,10)) error(2, errno, "Blurring: %s", ImageErrMsg());
     InstrPrint();
 
     ImageDestroy(&nb1);
@@ -80,7 +80,7 @@ int main(int argc, char* argv[]) {
     nb1 = ImageCrop(cp1, 0, 0, ImageWidth(img1), ImageHeight(img1));//84
     printf("\n# Otimizado:\n # BLUR image (size: %d - window %dx%d) com dx = %d e dy = %d\n", n,ImageWidth(img1),ImageHeight(img1),20,20);
     InstrReset();
-    ImageBlur(nb1,20,20);
+    if (!ImageBlur(nb1,20,20)) error(2, errno, "Blurring: %s", ImageErrMsg());
     InstrPrint();
 
     ImageDestroy(&nb1);
@@ -121,11 +121,14 @@ int main(int argc, char* argv[]) {
       InstrReset();
       printf("\n# Otimizado:\n # Locate image (size: %d - window %dx%d) in image (size: %d - window %dx%d)\n",size,(int)ImageWidth(crop),(int)ImageHeight(crop), n,ImageWidth(img1),ImageHeight(img1));
       res = ImageLocateSubImage(nb1,&px,&py,crop);
-      printf("\n# Best Case ?=? encontra (Sucess = %d FOUND(%d,%d))\n",res,px,py);
+      if (res < 0) error(2, errno, "Locating: %s", ImageErrMsg());
+      if (res == 1) printf("\n# Best Case ?=? encontra (Sucess = %d FOUND(%d,%d))\n",res,px,py);
+      else printf("\n# Best Case ?=? encontra (Sucess = %d NOTFOUND)\n",res);
       InstrPrint();
       MassSetting(crop,101);
       InstrReset();
       res = ImageLocateSubImage(nb1,&px,&py,crop);
+      if (res < 0) error(2, errno, "Locating: %s", ImageErrMsg());
       printf("\n# Best Case ?=? não encontra (Sucess = %d NOTFOUND)\n",res);
       InstrPrint();
       /*MassSetting(crop,100);
@@ -135,6 +138,7 @@ int main(int argc, char* argv[]) {
       ImageSetPixel(crop,ImageWidth(crop)-2,ImageHeight(crop)-2,99);
       InstrReset();
       res = ImageLocateSubImage(nb1,&px,&py,crop);
+      if (res < 0) error(2, errno, "Locating: %s", ImageErrMsg());
       printf("\n# Worst Case ?=? não encontra (Sucess = %d NOTFOUND)\n",res);
       InstrPrint();
       */
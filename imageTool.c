@@ -15,13 +15,23 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <glob.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [-O0] [FILE...] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
+    "  The pipeline is optimized before it runs (fusing point operations,\n"
+    "  folding rotations and mirrors, cropping before blurs, and dropping\n"
+    "  images that are never saved or queried), unless -O0 is given.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
     "  Some operations create images, which are appended to an internal buffer:\n"
@@ -29,33 +39,103 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  Images may be named (as NAME) and brought back later (use NAME).\n"
+    "  Images that no later operation can use (unnamed, below PRED, or named\n"
+    "  but never used again) are freed as the pipeline goes.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in raw (P5) or plain (P2) PGM format are accepted.\n"
+    "  Files with 16-bit levels are scaled down to 8 bits when loaded.\n"
+    "  Images are always saved in 8-bit raw PGM format.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
+    "  map FILE        Map PGM image file in memory (copy-on-write), creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
+    "  stream IN OUT OPERATION...\n"
+    "                  Apply all remaining operations (neg, thr, bri, blur only)\n"
+    "                  to PGM file IN, band by band, writing OUT.\n"
+    "                  IN may be larger than the available memory.\n"
+    "  band ROWS       Set number of rows per band in stream (default 64)\n"
+    "  frames IN OUT OPERATION...\n"
+    "                  Apply all remaining operations to every frame of the\n"
+    "                  multi-frame PGM stream IN, writing CURR of each frame\n"
+    "                  to OUT (- for stdin/stdout).  Each frame starts as I0.\n"
+    "  batch OUT INPUT... [-- OPERATION...]\n"
+    "                  Apply the operations after -- to each INPUT file, in\n"
+    "                  parallel, saving CURR of each one to file OUT, where\n"
+    "                  %s stands for the input name without extension and %d\n"
+    "                  for its index.  INPUT may be a glob pattern, or @LIST to\n"
+    "                  read input names from file LIST.  Each input starts as I0.\n"
+    "  jobs N          Set number of worker threads in batch (default: #cpus)\n"
+    "  prefetch N      Read up to N inputs ahead in batch (default: 2, 0: off)\n"
+    "  writeq N        Leave up to N saves in progress per batch worker, while\n"
+    "                  the next input is processed (default: 2, 0: off)\n"
+    "  serve SOCKET    Read further commands (operations and operands, as above)\n"
+    "                  line by line from clients of Unix domain socket SOCKET,\n"
+    "                  one at a time, or from stdin if SOCKET is -, keeping\n"
+    "                  images between commands.  Each command is answered by\n"
+    "                  a line \"OK N [W H]\" (N images, CURR is WxH) or\n"
+    "                  \"ERR CODE MESSAGE\".  \"quit\" stops.  Timing scopes\n"
+    "                  are kept per client, until printed by report\n"
+    "  keep N          Destroy images, keeping only the first N\n"
+    "  as NAME         Name CURR NAME\n"
+    "  use NAME        Move image named NAME to the top of the buffer (CURR)\n"
+    "  pool MB         Keep up to MB megabytes of destroyed images for reuse by\n"
+    "                  new images of the same size (default 64, 0: off)\n"
+    "  budget MB       Limit memory of images other than CURR and PRED to MB\n"
+    "                  megabytes, spilling least recently used ones to files\n"
+    "                  in $TMPDIR (reloaded when used)\n"
     "  info            Show information on CURR (size and range)\n"
+    "  cache           Keep sum tables and histogram of CURR, updated only\n"
+    "                  where it changes (speeds up repeated locate and info)\n"
+    "  probe FILE      Show size, maxval and pixel data offset of FILE,\n"
+    "                  reading only its header\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  perf            Also measure hardware counters in tic/toc, if possible\n"
+    "  begin NAME      Open a named timing scope (scopes may be nested)\n"
+    "  end             Close the innermost timing scope\n"
+    "  report FORMAT   Print timing scopes as text, csv or json\n"
+    "                  (every operation is timed in a scope of its own)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
+    "  lut OP,...      Apply point operations neg, thr:LEVEL, bri:FACTOR to CURR\n"
+    "                  in a single pass\n"
+    "\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  turn            Rotate CURR 180º, creating new image\n"
+    "  xform OP,...    Apply geometric transformations rotate, mirror, turn and\n"
+    "                  crop:X:Y:W:H to CURR with a single copy, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  crop X,Y,W,H,MX,MY\n"
+    "                  Crop the rectangle expanded by MX,MY on each side,\n"
+    "                  within CURR, creating new image\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  compare X,Y     Compare PRED to subimage of CURR at position (X,Y), print\n"
+    "                  number of mismatches, maximum error, MSE and PSNR\n"
+    "\n"
+    "  diff            Replace CURR by |CURR - PRED| (same size)\n"
+    "  motion LEVEL    Replace CURR by mask of |CURR - PRED| >= LEVEL (same size),\n"
+    "                  print number and bounding box of changed pixels\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  gauss SIGMA     blur CURR using approximate Gaussian filter of standard\n"
+    "                  deviation SIGMA (3 mean filters; time independent of SIGMA)\n"
+    "\n"
+    "  neg@X,Y,W,H     Apply neg to the rectangle (X,Y,W,H) of CURR only; likewise\n"
+    "                  thr@X,Y,W,H LEVEL, bri@X,Y,W,H FACTOR and blur@X,Y,W,H DX,DY\n"
+    "                  (blur reads the pixels around the rectangle)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -69,11 +149,13 @@ static char* errors[] = {
   "Success",
   "Insufficient operands",
   "Insufficient images",
-  "Image buffer is full",
+  "Image buffer allocation failed",
   "Image8bit failure: %s",
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Images differ in size",
+  "Some batch files failed",
 };
 
 
@@ -85,142 +167,1655 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+#define MAX(X,Y) (((X)>(Y)) ? (X) : (Y))
+#define MIN(X,Y) (((X)<(Y)) ? (X) : (Y))
+
+// An image in the buffer
+typedef struct {
+  Image img;            // the image (NULL while spilled)
+  ImageSaveJob job;     // pending save (or NULL)
+  char* name;           // name given by "as" (or NULL)
+  char* spill;          // file holding the image while spilled (or NULL)
+  unsigned long used;   // time of last use, for eviction
+} Entry;
+
+// State of the pipeline interpreter
+typedef struct {
+  Entry* e;       // the image buffer (grows as needed)
+  int cap;        // capacity of e
+  int n;          // number of images created
+  int band;       // rows per band in stream
+  int jobs;       // number of worker threads in batch
+  int prefetch;   // number of inputs read ahead in batch (0: none)
+  int writeq;     // number of saves in progress per batch worker (0: none)
+  int worker;     // nonzero in batch workers: no messages or timing scopes
+  int autofree;   // nonzero to free images that can no longer be used
+  size_t budget;  // memory for resident images other than CURR and PRED (0: no limit)
+  double poolmb;  // megabytes of free images kept for reuse (0: no pool)
+  ImagePool pool; // pool of images created by this state's thread (or NULL)
+  ImageWorkspace ws;    // scratch tables of blur, gauss and locate (or NULL)
+  unsigned long tick;   // use counter
+} State;
+
+// Report progress of operations, except in batch workers
+#define LOG(...) do { if (!st->worker) fprintf(stderr, __VA_ARGS__); } while (0)
+
+// Make room for at least size images in the buffer.  Returns an error code.
+static int Grow(State* st, int size) {
+  if (size <= st->cap) return 0;
+  int cap = MAX(size, 2*st->cap + 8);
+  Entry* e = realloc(st->e, cap * sizeof(Entry));
+  if (e == NULL) return 3;
+  memset(e + st->cap, 0, (cap - st->cap) * sizeof(Entry));
+  st->e = e;
+  st->cap = cap;
+  return 0;
+}
+
+// Wait for the pending save of image i, if any, before it is modified or
+// destroyed.  Returns an error code.
+static int Settle(State* st, int i) {
+  if (st->e[i].job == NULL) return 0;
+  return ImageSaveWait(&st->e[i].job) ? 0 : 4;
+}
+
+// Destroy image i (which must be settled) and its name and spill file.
+static void Discard(State* st, int i) {
+  Entry* e = &st->e[i];
+  ImageDestroy(&e->img);
+  if (e->spill != NULL) remove(e->spill);
+  free(e->spill);
+  free(e->name);
+  memset(e, 0, sizeof(*e));
+}
+
+// Wait for pending saves and destroy images down to st->n == keep.
+// The buffer itself is freed when keep == 0.
+// Returns an error code (of the first failed save).
+static int Release(State* st, int keep) {
+  int err = 0;
+  for (int i = 0; i < st->n; i++) {
+    int e = Settle(st, i);
+    if (err == 0) err = e;
+  }
+  while (st->n > keep) Discard(st, --st->n);
+  if (keep == 0) {
+    free(st->e);
+    st->e = NULL;
+    st->cap = 0;
+  }
+  return err;
+}
+
+// Return the index of the image named name, or -1.
+static int Find(const State* st, const char* name) {
+  for (int i = 0; i < st->n; i++) {
+    if (st->e[i].name != NULL && strcmp(st->e[i].name, name) == 0) return i;
   }
+  return -1;
+}
 
-  ImageInit();
+// Move image i to the top of the buffer, making it CURR.
+static void Raise(State* st, int i) {
+  Entry e = st->e[i];
+  memmove(&st->e[i], &st->e[i+1], (st->n - i - 1) * sizeof(Entry));
+  st->e[st->n-1] = e;
+}
+
+// Check whether operations av[k..ac-1] refer to an image named name.
+static int LaterUse(int ac, char* av[], int k, const char* name) {
+  for (int j = k; j + 1 < ac; j++) {
+    if (strcmp(av[j], "use") == 0 && strcmp(av[j+1], name) == 0) return 1;
+  }
+  return 0;
+}
 
+// Check whether operations av[k..ac-1] may index any image: "keep" brings
+// lower images back to the top, and "serve" lets clients do so.
+static int LaterKeep(int ac, char* av[], int k) {
+  for (int j = k; j < ac; j++) {
+    if (strcmp(av[j], "keep") == 0 || strcmp(av[j], "serve") == 0) return 1;
+  }
+  return 0;
+}
+
+// With st->autofree, free the images that operations av[k..ac-1] cannot use:
+// only CURR and PRED are used by operations, so other images are dead
+// unless named and referred to by "use" later on, or unless a later "keep"
+// or "serve" may still reach them.  Returns an error code.
+static int Collect(State* st, int ac, char* av[], int k) {
+  if (!st->autofree || LaterKeep(ac, av, k)) return 0;
   int err = 0;
+  int m = 0;      // images kept so far
+  for (int i = 0; i < st->n; i++) {
+    if (i < st->n - 2 &&
+        (st->e[i].name == NULL || !LaterUse(ac, av, k, st->e[i].name))) {
+      int e = Settle(st, i);
+      if (err == 0) err = e;
+      LOG("Freeing I%d%s%s\n", i, st->e[i].name ? " " : "", st->e[i].name ? st->e[i].name : "");
+      Discard(st, i);
+    } else {
+      st->e[m++] = st->e[i];
+    }
+  }
+  for (int i = m; i < st->n; i++) memset(&st->e[i], 0, sizeof(Entry));
+  st->n = m;
+  return err;
+}
+
+// Make image i resident, reloading it if it was spilled.
+// Returns an error code.
+static int Restore(State* st, int i) {
+  Entry* e = &st->e[i];
+  e->used = ++st->tick;
+  if (e->img != NULL) return 0;
+  LOG("Reloading I%d from %s\n", i, e->spill);
+  if ((e->img = ImageLoad(e->spill)) == NULL) return 4;
+  remove(e->spill);
+  free(e->spill);
+  e->spill = NULL;
+  return 0;
+}
+
+// Spill least recently used images (other than CURR and PRED) to
+// temporary files, until the resident ones fit in st->budget bytes.
+// Returns an error code.
+static int Evict(State* st) {
+  if (st->budget == 0) return 0;
+  size_t resident = 0;   // of images other than CURR and PRED
+  for (int i = 0; i < st->n - 2; i++) {
+    if (st->e[i].img != NULL)
+      resident += (size_t)ImageWidth(st->e[i].img) * ImageHeight(st->e[i].img);
+  }
+  while (resident > st->budget) {
+    int v = -1;
+    for (int i = 0; i < st->n - 2; i++) {
+      if (st->e[i].img != NULL && (v < 0 || st->e[i].used < st->e[v].used)) v = i;
+    }
+    if (v < 0) break;   // nothing left to spill
+    Entry* e = &st->e[v];
+    int err = Settle(st, v);
+    if (err != 0) return err;
+    const char* dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+    size_t len = strlen(dir) + sizeof("/imageToolXXXXXX");
+    if ((e->spill = malloc(len)) == NULL) return 3;
+    snprintf(e->spill, len, "%s/imageToolXXXXXX", dir);
+    int fd = mkstemp(e->spill);
+    if (fd < 0) { free(e->spill); e->spill = NULL; return 5; }
+    close(fd);
+    LOG("Spilling I%d to %s\n", v, e->spill);
+    if (ImageSave(e->img, e->spill) == 0) {
+      remove(e->spill);
+      free(e->spill);
+      e->spill = NULL;
+      return 4;
+    }
+    resident -= (size_t)ImageWidth(e->img) * ImageHeight(e->img);
+    ImageDestroy(&e->img);
+  }
+  return 0;
+}
+
+// Replace the image pool of st (used in the calling thread) by a new one
+// with the size given by st->poolmb.
+static void NewPool(State* st) {
+  if (st->pool != NULL) ImageUsePool(NULL);
+  ImagePoolDestroy(&st->pool);
+  if (st->poolmb > 0.0) {
+    st->pool = ImagePoolCreate((size_t)(st->poolmb * 1024 * 1024), 1);
+    ImageUsePool(st->pool);
+  }
+}
+
+// Destroy the image pool and the workspace of st.
+static void FreePool(State* st) {
+  ImageUsePool(NULL);
+  ImagePoolDestroy(&st->pool);
+  ImageWorkspaceDestroy(&st->ws);
+}
+
+// Create the workspace of st, if not yet created.  Returns an error code.
+static int NeedWorkspace(State* st) {
+  if (st->ws == NULL) st->ws = ImageWorkspaceCreate();
+  return (st->ws == NULL) ? 4 : 0;
+}
+
+// Return a new empty state with the settings of st.
+static State SubState(const State* st) {
+  State sub = { .e = NULL, .cap = 0, .n = 0, .band = st->band, .jobs = st->jobs,
+                .prefetch = st->prefetch, .writeq = st->writeq,
+                .worker = st->worker, .autofree = st->autofree,
+                .budget = st->budget, .poolmb = st->poolmb, .pool = NULL,
+                .ws = NULL, .tick = 0 };
+  return sub;
+}
+
+static int Run(State* st, int ac, char* av[], int k);
+
+// Apply the pipeline av[k..ac-1] to every frame of a multi-frame PGM
+// stream read from infile, writing the resulting CURR of each frame to
+// outfile ("-" stands for stdin/stdout).
+// Frames are read into the same image, so in-place operations reuse its
+// buffer from frame to frame.  Returns an error code.
+static int RunFrames(State* st, const char* infile, const char* outfile,
+                     int ac, char* av[], int k) {
+  FILE* in = strcmp(infile, "-") == 0 ? stdin : fopen(infile, "rb");
+  FILE* out = strcmp(outfile, "-") == 0 ? stdout : fopen(outfile, "wb");
+  int err = (in == NULL || out == NULL) ? 5 : 0;
+  Image frame = NULL;
+  State sub = SubState(st);
+  sub.autofree = 0;   // the frame is kept from frame to frame
+  // Results of each frame have the same sizes, so recycle their memory
+  ImagePool prev = ImageUsePool(NULL);
+  NewPool(&sub);
+  int r;
+  int count = 0;
+  while (err == 0 && (r = ImageReadFrame(in, &frame)) != 0) {
+    if (r < 0) { err = 4; break; }
+    if ((err = Grow(&sub, 1)) != 0) break;
+    sub.e[0].img = frame;
+    sub.n = 1;
+    err = Run(&sub, ac, av, k);
+    if (err == 0 && sub.n == 0) err = 2;   // the pipeline left no image to write
+    if (err == 0 && ImageWriteFrame(out, sub.e[sub.n-1].img) == 0) err = 4;
+    // Destroy images created by the pipeline, but keep the frame for the
+    // next one.  It need not be I0 any more ("use" reorders the images),
+    // and is gone if the pipeline destroyed or spilled it.
+    int f = sub.n - 1;
+    while (f >= 0 && sub.e[f].img != frame) f--;
+    if (f >= 0) sub.e[f].img = NULL;
+    else frame = NULL;
+    int e = Release(&sub, 0);
+    if (err == 0) err = e;
+    count++;
+  }
+  fprintf(stderr, "Processed %d frames\n", count);
+  Release(&sub, 0);
+  ImageDestroy(&frame);
+  if (sub.pool != NULL) {
+    ImagePoolStat ps;
+    ImagePoolGetStat(sub.pool, &ps);
+    fprintf(stderr, "Image pool: %lu hits, %lu misses\n", ps.hits, ps.misses);
+  }
+  FreePool(&sub);
+  ImageUsePool(prev);
+  if (in != NULL && in != stdin) fclose(in);
+  if (out != NULL && out != stdout && fclose(out) != 0 && err == 0) err = 5;
+  if (out == stdout) fflush(out);
+  return err;
+}
+
+// Batch mode
+
+// An input image read ahead by the loader thread
+typedef struct {
+  int i;               // input index
+  Image img;           // NULL if load failed
+  const char* cause;   // error cause, if load failed
+} Loaded;
+
+// Shared state of the batch workers
+typedef struct {
+  const State* st;     // settings
+  const char* templ;   // output file name template
+  char** input;        // input files
+  int ninputs;
+  int ac;              // pipeline is av[k..ac-1]
+  char** av;
+  int k;
+  pthread_mutex_t lock;
+  int next;            // next input to process (or load, with prefetch)
+  int failed;          // number of failed files
+  double pixels;       // total pixels processed
+  // Prefetch queue (when st->prefetch > 0), filled by the loader thread
+  pthread_cond_t ready;    // signaled when an image is queued
+  pthread_cond_t room;     // signaled when an image is taken
+  Loaded* queue;       // circular queue of st->prefetch entries
+  int head;            // first entry in queue
+  int count;           // number of entries in queue
+} Batch;
+
+// A save in progress in a batch worker
+typedef struct {
+  ImageSaveJob job;
+  Image img;           // image being saved
+  int i;               // input index
+  char out[1024];      // output file name
+  double t0;           // start time
+  double pixels;
+} Pending;
+
+// Expand output file name template for input file number i:
+// %s is replaced by the input base name without extension, %d by i, %% by %.
+static void ExpandTemplate(char* out, size_t size, const char* templ,
+                           const char* input, int i) {
+  const char* base = strrchr(input, '/');
+  base = (base != NULL) ? base + 1 : input;
+  const char* dot = strrchr(base, '.');
+  int blen = (dot != NULL && dot != base) ? (int)(dot - base) : (int)strlen(base);
+  size_t o = 0;
+  for (const char* c = templ; *c != '\0' && o + 1 < size; c++) {
+    int r = 0;
+    if (c[0] == '%' && c[1] == 's') { r = snprintf(out + o, size - o, "%.*s", blen, base); c++; }
+    else if (c[0] == '%' && c[1] == 'd') { r = snprintf(out + o, size - o, "%d", i); c++; }
+    else if (c[0] == '%' && c[1] == '%') { out[o] = '%'; r = 1; c++; }
+    else { out[o] = *c; r = 1; }
+    o = MIN(o + (size_t)r, size - 1);
+  }
+  out[o] = '\0';
+}
+
+// Loader thread: read inputs ahead, in order, into the prefetch queue,
+// waiting while it is full.
+static void* BatchLoader(void* arg) {
+  Batch* b = arg;
+  int depth = b->st->prefetch;
+  ImageContext ctx = ImageContextCreate();   // own counters (NULL: shared)
+  ImageUseContext(ctx);
+  for (int i = 0; i < b->ninputs; i++) {
+    pthread_mutex_lock(&b->lock);
+    while (b->count == depth) pthread_cond_wait(&b->room, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+
+    Loaded l = { .i = i, .img = ImageLoad(b->input[i]), .cause = NULL };
+    if (l.img == NULL) l.cause = ImageErrMsg();
+
+    pthread_mutex_lock(&b->lock);
+    b->queue[(b->head + b->count) % depth] = l;
+    b->count++;
+    pthread_cond_signal(&b->ready);
+    pthread_mutex_unlock(&b->lock);
+  }
+  ImageContextDestroy(&ctx);
+  return NULL;
+}
+
+// Take the next input, loaded by the loader thread or else loaded here.
+// Returns 0 when no inputs are left.
+static int BatchTake(Batch* b, Loaded* l) {
+  int depth = b->st->prefetch;
+  pthread_mutex_lock(&b->lock);
+  int i = b->next++;
+  if (i < b->ninputs && depth > 0) {
+    // Inputs are queued in order, so entry i is queued before entry i+1
+    while (b->count == 0) pthread_cond_wait(&b->ready, &b->lock);
+    *l = b->queue[b->head];
+    b->head = (b->head + 1) % depth;
+    b->count--;
+    pthread_cond_signal(&b->room);
+  }
+  pthread_mutex_unlock(&b->lock);
+  if (i >= b->ninputs) return 0;
+  if (depth == 0) {
+    l->i = i;
+    l->img = ImageLoad(b->input[i]);
+    l->cause = (l->img == NULL) ? ImageErrMsg() : NULL;
+  }
+  return 1;
+}
+
+// Report the outcome of processing input i and account for it.
+static void BatchDone(Batch* b, int i, const char* out, double t0, double pixels,
+                      int err, const char* cause) {
+  double t = wall_time() - t0;
+  if (err != 0) {
+    fprintf(stderr, "FAILED %s: ", b->input[i]);
+    fprintf(stderr, errors[err], cause);
+    fputc('\n', stderr);
+  } else {
+    fprintf(stderr, "%s -> %s: %.0f pixels in %.6f s (%.1f MB/s)\n", b->input[i],
+            out, pixels, t, t > 0.0 ? pixels / t * 1.0e-6 : 0.0);
+  }
+  pthread_mutex_lock(&b->lock);
+  if (err != 0) b->failed++;
+  b->pixels += pixels;
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Wait for a pending save to complete, report it and destroy its image.
+static void BatchFinish(Batch* b, Pending* p) {
+  int err = ImageSaveWait(&p->job) ? 0 : 4;
+  BatchDone(b, p->i, p->out, p->t0, p->pixels, err, ImageErrMsg());
+  ImageDestroy(&p->img);
+}
+
+// Worker thread: process and save input files until none is left.
+// Up to st->writeq saves are left in progress while the next input is
+// processed.
+static void* BatchWorker(void* arg) {
+  Batch* b = arg;
+  State sub = SubState(b->st);
+  sub.worker = 1;
+  ImageContext ctx = ImageContextCreate();   // own counters (NULL: shared)
+  ImageUseContext(ctx);
+  NewPool(&sub);
+  int depth = b->st->writeq;
+  Pending pending[MAX(depth, 1)];
+  int first = 0;       // oldest pending save
+  int npending = 0;
+  Loaded l = { .i = 0, .img = NULL, .cause = NULL };
+  while (BatchTake(b, &l)) {
+    int i = l.i;
+    char out[sizeof(pending[0].out)];
+    ExpandTemplate(out, sizeof(out), b->templ, b->input[i], i);
+    double t0 = wall_time();
+    if (l.img == NULL) { BatchDone(b, i, out, t0, 0.0, 4, l.cause); continue; }
+
+    int err = Grow(&sub, 1);
+    if (err != 0) { BatchDone(b, i, out, t0, 0.0, err, NULL); ImageDestroy(&l.img); continue; }
+    sub.e[0].img = l.img;
+    sub.n = 1;
+    double pixels = (double)ImageWidth(l.img) * ImageHeight(l.img);
+    err = Run(&sub, b->ac, b->av, b->k);
+    if (err == 0 && sub.n == 0) err = 2;   // the pipeline left no image to save
+    // Detach the result from the image set, and release the others
+    Image res = NULL;
+    if (err == 0) { res = sub.e[sub.n-1].img; sub.e[sub.n-1].img = NULL; }
+    int e = Release(&sub, 0);
+    if (err == 0) err = e;
+
+    if (err != 0 || depth == 0) {
+      if (err == 0 && ImageSave(res, out) == 0) err = 4;
+      BatchDone(b, i, out, t0, pixels, err, ImageErrMsg());
+      ImageDestroy(&res);
+      continue;
+    }
+    if (npending == depth) {
+      BatchFinish(b, &pending[first]);
+      first = (first + 1) % depth;
+      npending--;
+    }
+    Pending* p = &pending[(first + npending) % depth];
+    if ((p->job = ImageSaveAsync(res, out)) == NULL) {
+      BatchDone(b, i, out, t0, pixels, 4, ImageErrMsg());
+      ImageDestroy(&res);
+      continue;
+    }
+    p->img = res;
+    p->i = i;
+    strcpy(p->out, out);
+    p->t0 = t0;
+    p->pixels = pixels;
+    npending++;
+  }
+  for ( ; npending > 0; npending--) {
+    BatchFinish(b, &pending[first]);
+    first = (first + 1) % depth;
+  }
+  FreePool(&sub);
+  ImageContextDestroy(&ctx);
+  return NULL;
+}
+
+// Apply the pipeline av[k..ac-1] to every input file, in st->jobs worker
+// threads (each one holds at most one image set at a time), saving the
+// resulting CURR to the file named by templ.
+// With st->prefetch > 0, a loader thread reads up to that many inputs
+// ahead, so that reading overlaps processing; saves are done in the
+// background (see BatchWorker).  Returns an error code.
+static int RunBatch(const State* st, const char* templ, char** input, int ninputs,
+                    int ac, char* av[], int k) {
+  Batch b = { .st = st, .templ = templ, .input = input, .ninputs = ninputs,
+              .ac = ac, .av = av, .k = k, .next = 0, .failed = 0,
+              .pixels = 0.0, .queue = NULL, .head = 0, .count = 0 };
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.ready, NULL);
+  pthread_cond_init(&b.room, NULL);
+  State set = *st;
+  b.st = &set;
+  pthread_t loader;
+  if (set.prefetch > 0 && ((b.queue = malloc(set.prefetch * sizeof(Loaded))) == NULL ||
+                           pthread_create(&loader, NULL, BatchLoader, &b) != 0)) {
+    set.prefetch = 0;   // load in the workers
+  }
+  int nthreads = MAX(1, MIN(st->jobs, ninputs));
+  pthread_t thread[nthreads];
+  double t0 = wall_time();
+  int started = 0;
+  while (started < nthreads &&
+         pthread_create(&thread[started], NULL, BatchWorker, &b) == 0) started++;
+  if (started == 0) {   // no threads: work here
+    ImagePool prev = ImageUsePool(NULL);
+    BatchWorker(&b);
+    ImageUsePool(prev);
+  }
+  for (int i = 0; i < started; i++) pthread_join(thread[i], NULL);
+  if (set.prefetch > 0) pthread_join(loader, NULL);
+  double t = wall_time() - t0;
+  free(b.queue);
+  pthread_cond_destroy(&b.room);
+  pthread_cond_destroy(&b.ready);
+  pthread_mutex_destroy(&b.lock);
+  fprintf(stderr, "Batch: %d files (%d failed) with %d workers, %.0f pixels in %.6f s (%.1f MB/s)\n",
+          ninputs, b.failed, MAX(started, 1), b.pixels, t, t > 0.0 ? b.pixels / t * 1.0e-6 : 0.0);
+  return (b.failed > 0) ? 9 : 0;
+}
+
+// Collect input files from av[k..], up to "--" or the end, into a new
+// array (*inputs).  "@LIST" stands for the files named in file LIST (one per
+// line), and arguments with wildcards are expanded with glob.
+// Returns the number of inputs (and sets *end to the index after "--"),
+// or -1 on failure.
+static int CollectInputs(int ac, char* av[], int k, glob_t* g, int* end) {
+  int flags = 0;
+  for ( ; k < ac && strcmp(av[k], "--") != 0; k++) {
+    if (av[k][0] == '@') {
+      FILE* f = fopen(av[k] + 1, "r");
+      if (f == NULL) return -1;
+      char line[4096];
+      while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+        if (glob(line, flags | GLOB_NOCHECK | GLOB_NOESCAPE, NULL, g) != 0) { fclose(f); return -1; }
+        flags = GLOB_APPEND;
+      }
+      fclose(f);
+    } else {
+      if (glob(av[k], flags | GLOB_NOCHECK, NULL, g) != 0) return -1;
+      flags = GLOB_APPEND;
+    }
+  }
+  *end = (k < ac) ? k + 1 : k;
+  return (flags != 0) ? (int)g->gl_pathc : 0;
+}
+
+// Fill lut with the combined effect of the point operations in spec, a
+// comma separated list of neg, thr:LEVEL and bri:FACTOR, on images with
+// the given maxval.  Returns 0 if spec is invalid.
+static int MakeLUT(uint8 lut[], const char* spec, uint8 maxval) {
+  for (int v = 0; v <= PixMax; v++) lut[v] = (uint8)v;
+  const char* s = spec;
+  while (*s != '\0') {
+    int len;
+    uint8 thr;
+    double factor;
+    if (strncmp(s, "neg", 3) == 0 && (s[3] == ',' || s[3] == '\0')) {
+      len = 3;
+      for (int v = 0; v <= PixMax; v++) lut[v] = PixMax - lut[v];
+    } else if (sscanf(s, "thr:%hhu%n", &thr, &len) == 1) {
+      for (int v = 0; v <= PixMax; v++) lut[v] = (lut[v] < thr) ? 0 : maxval;
+    } else if (sscanf(s, "bri:%lf%n", &factor, &len) == 1) {
+      // As in ImageBrighten
+      for (int v = 0; v <= PixMax; v++) {
+        lut[v] = (lut[v] * factor + 0.5 > maxval) ? maxval : (uint8)(lut[v] * factor + 0.5);
+      }
+    } else {
+      return 0;
+    }
+    s += len;
+    if (*s == ',') s++;
+    else if (*s != '\0') return 0;
+  }
+  return 1;
+}
+
+// Set *v to the view of img through the geometric transformations in
+// spec, a comma separated list of rotate, mirror, turn and crop:X:Y:W:H.
+// Returns 0 if spec is invalid (or a crop falls outside the view).
+static int MakeView(ImageView* v, const char* spec, Image img) {
+  *v = ImageViewOf(img);
+  const char* s = spec;
+  while (*s != '\0') {
+    int len = (int)strcspn(s, ",");
+    int x, y, w, h, end = 0;
+    if (len == 6 && strncmp(s, "rotate", 6) == 0) {
+      *v = ImageViewRotate(*v);
+    } else if (len == 6 && strncmp(s, "mirror", 6) == 0) {
+      *v = ImageViewMirror(*v);
+    } else if (len == 4 && strncmp(s, "turn", 4) == 0) {
+      *v = ImageViewRotate(ImageViewRotate(*v));
+    } else if (sscanf(s, "crop:%d:%d:%d:%d%n", &x, &y, &w, &h, &end) == 4 && end == len) {
+      if (!ImageViewValidRect(*v, x, y, w, h)) return 0;   // precondition check!
+      *v = ImageViewCrop(*v, x, y, w, h);
+    } else {
+      return 0;
+    }
+    s += len;
+    if (*s == ',') s++;
+  }
+  return 1;
+}
+
+// Pipeline compiler
+//
+// Before execution, the pipeline is parsed into a list of operations on
+// symbolic image values (a DAG: each operation reads some values and
+// creates or modifies one), which is then optimized and turned back into
+// an (equivalent, but faster) argument list for Run:
+//   - operations on images that are never saved or queried are dropped;
+//   - adjacent point operations (neg, thr, bri) are fused into one lut;
+//   - rotate rotate becomes turn, and mirror mirror or turn turn vanish;
+//   - other chains of rotate, mirror, turn and crop become one xform, which
+//     composes them as a view and copies pixels once;
+//   - crop is moved before the point operations and blurs that precede
+//     it, cropping a rectangle expanded by the blur margin first and the
+//     exact rectangle after them.
+// Rewrites are only done where no operation can tell the difference,
+// e.g. an intermediate image that PRED would refer to must be unused.
+
+// Kinds of operations, by their effect on images
+typedef enum {
+  K_LOAD,     // create value from file (always executed)
+  K_NEW,      // create value from nothing
+  K_UNARY,    // create value from CURR
+  K_POINT,    // modify CURR in place, pixel by pixel
+  K_BLUR,     // modify CURR in place
+  K_RECT,     // modify a rectangle of CURR in place (NAME@X,Y,W,H)
+  K_BINARY,   // modify CURR in place, reading PRED
+  K_QUERY1,   // read CURR, with output or I/O
+  K_QUERY2,   // read CURR and PRED, with output
+  K_NAME,     // as
+  K_USE,      // use
+  K_SETTING,  // no effect on images
+  K_ALL,      // instrumentation: observes all work done before it
+  K_STOP,     // keep, serve: stop optimizing here
+  K_TAIL,     // stream, frames, batch: consume the remaining arguments
+} OpKind;
+
+static const struct {
+  const char* name;
+  int nargs;
+  OpKind kind;
+} opTable[] = {
+  { "neg", 0, K_POINT }, { "thr", 1, K_POINT }, { "bri", 1, K_POINT },
+  { "lut", 1, K_POINT }, { "blur", 1, K_BLUR }, { "gauss", 1, K_BLUR },
+  { "neg@", 0, K_RECT }, { "thr@", 1, K_RECT }, { "bri@", 1, K_RECT }, { "blur@", 1, K_RECT },
+  { "rotate", 0, K_UNARY }, { "mirror", 0, K_UNARY }, { "turn", 0, K_UNARY },
+  { "crop", 1, K_UNARY }, { "xform", 1, K_UNARY },
+  { "create", 1, K_NEW }, { "map", 1, K_LOAD },
+  { "paste", 1, K_BINARY }, { "blend", 1, K_BINARY }, { "diff", 0, K_BINARY },
+  { "motion", 1, K_BINARY },
+  { "info", 0, K_QUERY1 }, { "save", 1, K_QUERY1 }, { "cache", 0, K_QUERY1 },
+  { "locate", 0, K_QUERY2 }, { "compare", 1, K_QUERY2 },
+  { "as", 1, K_NAME }, { "use", 1, K_USE },
+  { "band", 1, K_SETTING }, { "jobs", 1, K_SETTING }, { "prefetch", 1, K_SETTING },
+  { "writeq", 1, K_SETTING }, { "budget", 1, K_SETTING }, { "pool", 1, K_SETTING }, { "probe", 1, K_SETTING },
+  { "tic", 0, K_ALL }, { "toc", 0, K_ALL }, { "perf", 0, K_ALL },
+  { "begin", 1, K_ALL }, { "end", 0, K_ALL }, { "report", 1, K_ALL },
+  { "keep", 1, K_STOP }, { "serve", 1, K_STOP },
+  { "stream", 0, K_TAIL }, { "frames", 0, K_TAIL }, { "batch", 0, K_TAIL },
+};
+
+// An operation of the pipeline
+typedef struct {
+  const char* op;   // operation name (NULL to load file arg)
+  char* arg;        // operand (NULL if none)
+  OpKind kind;
+  int pushed;       // crop produced by pushing a crop down (not pushed again)
+  // Set by Simulate:
+  int read[2];      // values read (CURR, PRED), or -1
+  int out;          // value created, or -1
+  int mod;          // value modified in place, or -1
+  int nv;           // number of values created before this operation
+} Op;
+
+// Argument list under construction
+typedef struct {
+  char** v;
+  int n;
+  int cap;
+} Args;
+
+// Check whether arg names operation name (a prefix, if name ends in '@').
+static int OpMatches(const char* arg, const char* name) {
+  size_t len = strlen(name);
+  return (len > 0 && name[len-1] == '@') ? strncmp(arg, name, len) == 0
+                                         : strcmp(arg, name) == 0;
+}
+
+static int ArgsPush(Args* a, const char* s) {
+  if (a->n == a->cap) {
+    int cap = 2*a->cap + 16;
+    char** v = realloc(a->v, cap * sizeof(char*));
+    if (v == NULL) return 0;
+    a->v = v;
+    a->cap = cap;
+  }
+  if ((a->v[a->n] = strdup(s)) == NULL) return 0;
+  a->n++;
+  return 1;
+}
+
+static void ArgsFree(Args* a) {
+  for (int i = 0; i < a->n; i++) free(a->v[i]);
+  free(a->v);
+  a->v = NULL;
+  a->n = a->cap = 0;
+}
+
+// Program under optimization
+typedef struct {
+  Op* op;
+  int n;
+  int d0;             // number of images (values) present at the start
+  const char* const* names;   // their names (or NULL)
+  int endmode;        // values read at the end: 0 none, 1 CURR, 2 all
+  int nv;             // number of values
+  char* endlive;      // values read at the end (nv entries)
+} Prog;
+
+// Set the values read, created and modified by each operation, simulating
+// the image buffer.  Returns 0 if the program cannot be analysed (e.g.
+// it fails by lack of images or uses an unknown name).
+static int Simulate(Prog* p) {
+  int cap = p->d0 + p->n;
+  int* stack = malloc(cap * sizeof(int));
+  const char** name = malloc(cap * sizeof(char*));   // name of each value
+  free(p->endlive);
+  p->endlive = calloc(cap, 1);
+  if (stack == NULL || name == NULL || p->endlive == NULL) {
+    free(stack); free(name);
+    return 0;
+  }
+  int sp = 0;
+  int nv = 0;
+  for (int i = 0; i < p->d0; i++) {
+    name[nv] = (p->names != NULL) ? p->names[i] : NULL;
+    stack[sp++] = nv++;
+  }
+  int ok = 1;
+  for (int i = 0; ok && i < p->n; i++) {
+    Op* o = &p->op[i];
+    o->read[0] = o->read[1] = o->out = o->mod = -1;
+    o->nv = nv;
+    int curr = (sp > 0) ? stack[sp-1] : -1;
+    int pred = (sp > 1) ? stack[sp-2] : -1;
+    switch (o->kind) {
+    case K_LOAD: case K_NEW:
+      name[nv] = NULL;
+      stack[sp++] = o->out = nv++;
+      break;
+    case K_UNARY:
+      if (curr < 0) { ok = 0; break; }
+      o->read[0] = curr;
+      name[nv] = NULL;
+      stack[sp++] = o->out = nv++;
+      break;
+    case K_POINT: case K_BLUR: case K_RECT:
+      if (curr < 0) { ok = 0; break; }
+      o->read[0] = o->mod = curr;
+      break;
+    case K_BINARY:
+      if (pred < 0) { ok = 0; break; }
+      o->read[0] = o->mod = curr;
+      o->read[1] = pred;
+      break;
+    case K_QUERY1:
+      if (curr < 0) { ok = 0; break; }
+      o->read[0] = curr;
+      break;
+    case K_QUERY2:
+      if (pred < 0) { ok = 0; break; }
+      o->read[0] = curr;
+      o->read[1] = pred;
+      break;
+    case K_NAME:
+      if (curr < 0) { ok = 0; break; }
+      for (int v = 0; v < nv; v++) {
+        if (name[v] != NULL && strcmp(name[v], o->arg) == 0) name[v] = NULL;
+      }
+      name[curr] = o->arg;
+      o->read[0] = curr;
+      break;
+    case K_USE: {
+      int j = sp - 1;
+      while (j >= 0 && (name[stack[j]] == NULL || strcmp(name[stack[j]], o->arg) != 0)) j--;
+      if (j < 0) { ok = 0; break; }
+      o->read[0] = stack[j];
+      memmove(&stack[j], &stack[j+1], (sp - j - 1) * sizeof(int));
+      stack[sp-1] = o->read[0];
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  if (ok && p->endmode == 1 && sp > 0) p->endlive[stack[sp-1]] = 1;
+  if (ok && p->endmode == 2) for (int j = 0; j < sp; j++) p->endlive[stack[j]] = 1;
+  p->nv = nv;
+  free(stack);
+  free(name);
+  return ok;
+}
+
+// Check whether value v may be read after operation j.
+static int ReadAfter(const Prog* p, int v, int j) {
+  if (p->endlive[v]) return 1;
+  for (int i = j + 1; i < p->n; i++) {
+    const Op* o = &p->op[i];
+    if (o->read[0] == v || o->read[1] == v || o->mod == v) return 1;
+    if (o->kind == K_ALL && v < o->nv) return 1;
+  }
+  return 0;
+}
+
+// Operations that must be executed regardless of the values they produce
+static int HasEffect(const Op* o) {
+  return o->kind == K_LOAD || o->kind == K_QUERY1 || o->kind == K_QUERY2 ||
+         o->kind == K_NAME || o->kind == K_USE || o->kind == K_SETTING ||
+         o->kind == K_ALL || strcmp(o->op != NULL ? o->op : "", "motion") == 0;
+}
+
+// Remove operation i (which must have been freed), with count operations.
+static void RemoveOps(Prog* p, int i, int count) {
+  memmove(&p->op[i], &p->op[i+count], (p->n - i - count) * sizeof(Op));
+  p->n -= count;
+}
+
+static void FreeOp(Op* o) {
+  free(o->arg);
+  o->arg = NULL;
+}
+
+// Drop operations whose results are never read, by backward liveness.
+// Returns the number of operations dropped.
+static int DropDead(Prog* p) {
+  char* live = malloc(p->nv > 0 ? p->nv : 1);
+  if (live == NULL) return 0;
+  memcpy(live, p->endlive, p->nv);
+  int dropped = 0;
+  for (int i = p->n - 1; i >= 0; i--) {
+    Op* o = &p->op[i];
+    int needed = HasEffect(o) || (o->out >= 0 && live[o->out]) ||
+                 (o->mod >= 0 && live[o->mod]);
+    if (!needed) {
+      FreeOp(o);
+      RemoveOps(p, i, 1);
+      dropped++;
+      continue;
+    }
+    if (o->out >= 0) live[o->out] = 0;
+    if (o->read[0] >= 0) live[o->read[0]] = 1;
+    if (o->read[1] >= 0) live[o->read[1]] = 1;
+    if (o->kind == K_ALL) memset(live, 1, o->nv);
+  }
+  free(live);
+  return dropped;
+}
+
+// Append the lut specification of point operation o to spec.
+static void PointSpec(char* spec, size_t size, const Op* o) {
+  size_t len = strlen(spec);
+  const char* sep = (len > 0) ? "," : "";
+  if (strcmp(o->op, "neg") == 0) snprintf(spec + len, size - len, "%sneg", sep);
+  else if (strcmp(o->op, "lut") == 0) snprintf(spec + len, size - len, "%s%s", sep, o->arg);
+  else snprintf(spec + len, size - len, "%s%s:%s", sep, o->op, o->arg);
+}
+
+static int IsOp(const Op* o, const char* name) {
+  return o->op != NULL && strcmp(o->op, name) == 0;
+}
+
+// Check whether o is a geometric transformation that xform can express.
+static int IsGeometric(const Op* o) {
   int x, y, w, h;
+  char extra;
+  return IsOp(o, "rotate") || IsOp(o, "mirror") || IsOp(o, "turn") || IsOp(o, "xform") ||
+         (IsOp(o, "crop") && sscanf(o->arg, "%d,%d,%d,%d%c", &x, &y, &w, &h, &extra) == 4);
+}
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+// Append the xform specification of geometric transformation o to spec.
+static void GeometricSpec(char* spec, size_t size, const Op* o) {
+  size_t len = strlen(spec);
+  const char* sep = (len > 0) ? "," : "";
+  int x, y, w, h;
+  if (IsOp(o, "xform")) snprintf(spec + len, size - len, "%s%s", sep, o->arg);
+  else if (IsOp(o, "crop") && sscanf(o->arg, "%d,%d,%d,%d", &x, &y, &w, &h) == 4)
+    snprintf(spec + len, size - len, "%scrop:%d:%d:%d:%d", sep, x, y, w, h);
+  else snprintf(spec + len, size - len, "%s%s", sep, o->op);
+}
 
-  int k = 1;
+// Apply one rewrite to the program.  Returns 1 if one was applied.
+static int Rewrite(Prog* p) {
+  // Crop after point operations and blurs of an image that is not read
+  // any more: crop a rectangle with the blur margin before them.
+  for (int c = 0; c < p->n; c++) {
+    Op* o = &p->op[c];
+    if (!IsOp(o, "crop") || o->pushed) continue;
+    int x0 = o->read[0];
+    int j = c;
+    while (j > 0 && (p->op[j-1].kind == K_POINT || p->op[j-1].kind == K_BLUR) &&
+           p->op[j-1].mod == x0) j--;
+    if (j == c || ReadAfter(p, x0, c)) continue;
+    int x, y, w, h;
+    char extra;
+    if (sscanf(o->arg, "%d,%d,%d,%d%c", &x, &y, &w, &h, &extra) != 4) continue;
+    int mx = 0, my = 0, ok = 1;
+    for (int i = j; i < c; i++) {
+      if (p->op[i].kind != K_BLUR) continue;
+      int dx, dy;
+      if (IsOp(&p->op[i], "gauss")) ok = 0;   // margin not known here
+      else if (sscanf(p->op[i].arg, "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) ok = 0;
+      else { mx += dx; my += dy; }
+    }
+    if (!ok || x < 0 || y < 0) continue;
+    char outer[96], inner[64];
+    snprintf(outer, sizeof(outer), "%d,%d,%d,%d,%d,%d", x, y, w, h, mx, my);
+    snprintf(inner, sizeof(inner), "%d,%d,%d,%d", MIN(x, mx), MIN(y, my), w, h);
+    int margin = (mx > 0 || my > 0);
+    Op* op = realloc(p->op, (p->n + 1) * sizeof(Op));
+    if (op == NULL) return 0;
+    p->op = op;
+    o = &p->op[c];
+    char* arg1 = strdup(margin ? outer : o->arg);
+    char* arg2 = strdup(inner);
+    if (arg1 == NULL || arg2 == NULL) { free(arg1); free(arg2); return 0; }
+    Op crop = *o;   // crop moves before operations j..c-1
+    FreeOp(&crop);
+    crop.arg = arg1;
+    crop.pushed = 1;
+    memmove(&p->op[j+1], &p->op[j], (c - j) * sizeof(Op));
+    p->op[j] = crop;
+    if (margin) {   // and the exact rectangle is cropped after them
+      Op* last = &p->op[c+1];
+      memmove(last + 1, last, (p->n - c - 1) * sizeof(Op));
+      p->n++;
+      *last = crop;
+      last->arg = arg2;
+    } else {
+      free(arg2);
+    }
+    return 1;
+  }
+  for (int i = 0; i + 1 < p->n; i++) {
+    Op* a = &p->op[i];
+    Op* b = &p->op[i+1];
+    // Adjacent point operations apply to the same image
+    if (a->kind == K_POINT && b->kind == K_POINT) {
+      char spec[512] = "";
+      PointSpec(spec, sizeof(spec), a);
+      PointSpec(spec, sizeof(spec), b);
+      if (strlen(spec) + 1 >= sizeof(spec)) continue;
+      char* arg = strdup(spec);
+      if (arg == NULL) return 0;
+      FreeOp(a);
+      a->op = "lut";
+      a->arg = arg;
+      FreeOp(b);
+      RemoveOps(p, i+1, 1);
+      return 1;
+    }
+    // Second transformation reads the first one's image
+    if (a->kind == K_UNARY && b->read[0] == a->out && b->kind == K_UNARY &&
+        !ReadAfter(p, a->out, i+1)) {
+      if (IsOp(a, "rotate") && IsOp(b, "rotate")) {
+        a->op = "turn";
+        RemoveOps(p, i+1, 1);
+        return 1;
+      }
+      // b's image is a copy of a's source x, so x itself may take its
+      // place, if x is not read any more
+      if (((IsOp(a, "mirror") && IsOp(b, "mirror")) || (IsOp(a, "turn") && IsOp(b, "turn"))) &&
+          !ReadAfter(p, a->read[0], i+1)) {
+        RemoveOps(p, i, 2);
+        return 1;
+      }
+      // Any chain of geometric transformations needs a single copy
+      if (IsGeometric(a) && IsGeometric(b)) {
+        char spec[512] = "";
+        GeometricSpec(spec, sizeof(spec), a);
+        GeometricSpec(spec, sizeof(spec), b);
+        if (strlen(spec) + 1 >= sizeof(spec)) continue;
+        char* arg = strdup(spec);
+        if (arg == NULL) return 0;
+        FreeOp(a);
+        a->op = "xform";
+        a->arg = arg;
+        a->pushed = 0;
+        FreeOp(b);
+        RemoveOps(p, i+1, 1);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Compile operations av[k..ac-1], appending the result to out.
+// d0 images, named names[] (or NULL), are present at the start, and
+// endmode tells which images are read after the program (see Prog).
+// Returns 0 on failure (out of memory).
+static int Compile(int ac, char* av[], int k, int d0, const char* const* names,
+                   int endmode, Args* out) {
+  Prog p = { .op = malloc((ac - k + 1) * sizeof(Op)), .n = 0, .d0 = d0,
+             .names = names, .endmode = endmode, .nv = 0, .endlive = NULL };
+  if (p.op == NULL) return 0;
+  // Parse operations up to the end, or one that stops the optimization
+  int stop = k;
+  while (stop < ac) {
+    int t = 0;
+    int nt = sizeof(opTable) / sizeof(opTable[0]);
+    while (t < nt && !OpMatches(av[stop], opTable[t].name)) t++;
+    if (t < nt && (opTable[t].kind == K_STOP || opTable[t].kind == K_TAIL)) break;
+    Op* o = &p.op[p.n++];
+    memset(o, 0, sizeof(*o));
+    if (t == nt) {   // image file
+      o->op = NULL;
+      o->kind = K_LOAD;
+      o->arg = strdup(av[stop++]);
+    } else {
+      o->op = (o->kind = opTable[t].kind) == K_RECT ? av[stop] : opTable[t].name;
+      o->arg = NULL;
+      stop++;
+      if (opTable[t].nargs > 0) {
+        if (stop >= ac) { p.n--; stop--; break; }   // left for Run to report
+        o->arg = strdup(av[stop++]);
+      }
+    }
+    if (o->op == NULL && o->arg == NULL) { p.n--; break; }
+  }
+  int rest = stop;
+  if (rest < ac && (strcmp(av[rest], "keep") == 0 || strcmp(av[rest], "serve") == 0)) {
+    p.endmode = 2;   // they see all images
+  }
+
+  // Optimize, if the program is understood
+  int unchanged = 0;   // emit the arguments as given
+  if (Simulate(&p)) {
+    DropDead(&p);
+    while (Simulate(&p) && Rewrite(&p)) { }
+    if (!Simulate(&p)) unchanged = 1;   // should not happen
+  } else {
+    unchanged = 1;
+  }
+
+  int ok = 1;
+  if (unchanged) {
+    for (int i = k; ok && i < rest; i++) ok = ArgsPush(out, av[i]);
+  } else {
+    for (int i = 0; ok && i < p.n; i++) {
+      if (p.op[i].op != NULL) ok = ArgsPush(out, p.op[i].op);
+      if (ok && p.op[i].arg != NULL) ok = ArgsPush(out, p.op[i].arg);
+    }
+  }
+  for (int i = 0; i < p.n; i++) FreeOp(&p.op[i]);
+  free(p.op);
+  free(p.endlive);
+
+  // Remaining operations
+  if (ok && rest < ac) {
+    if (strcmp(av[rest], "frames") == 0 && rest + 2 < ac) {
+      for (int i = rest; ok && i < rest + 3; i++) ok = ArgsPush(out, av[i]);
+      return ok && Compile(ac, av, rest + 3, 1, NULL, 1, out);
+    }
+    if (strcmp(av[rest], "batch") == 0) {
+      int i = rest;
+      while (ok && i < ac && strcmp(av[i], "--") != 0) ok = ArgsPush(out, av[i++]);
+      if (i < ac) {
+        ok = ok && ArgsPush(out, av[i]);
+        return ok && Compile(ac, av, i + 1, 1, NULL, 1, out);
+      }
+      return ok;
+    }
+    for (int i = rest; ok && i < ac; i++) ok = ArgsPush(out, av[i]);
+  }
+  return ok;
+}
+
+// Server mode
+
+// Execute command lines read from in, each one a sequence of operations
+// and operands (as in the command line), on the images kept in st.
+// Output of operations and a reply line per command are written to stdout:
+//   OK N [W H]      success, N images in buffer, CURR is WxH
+//   ERR CODE MSG    failure (images created before the failure are kept)
+// Returns 1 if a "quit" command was read, or 0 at end of input.
+static int ServeStream(State* st, FILE* in) {
+  // Later commands are unknown, so images are kept until "keep"
+  int autofree = st->autofree;
+  st->autofree = 0;
+  InstrScopeClear();   // each session reports its own scopes
+  char* line = NULL;
+  size_t size = 0;
+  int quit = 0;
+  while (!quit && getline(&line, &size, in) >= 0) {
+    char* tok[256];
+    int ntok = 0;
+    char* save;
+    for (char* t = strtok_r(line, " \t\r\n", &save); t != NULL;
+         t = strtok_r(NULL, " \t\r\n", &save)) {
+      if (t[0] == '#' || ntok == 256) break;   // comment or too many
+      tok[ntok++] = t;
+    }
+    if (ntok == 0) continue;
+    int err = 0;
+    int reported = 0;   // command printed the scopes, which are then discarded
+    for (int i = 0; i < ntok; i++) reported |= (strcmp(tok[i], "report") == 0);
+    if (strcmp(tok[0], "quit") == 0) {
+      quit = 1;
+    } else if (strcmp(tok[0], "serve") == 0) {
+      err = 5;   // no nested servers
+    } else {
+      // Compile the command, knowing which images are present
+      const char* names[st->n + 1];
+      for (int i = 0; i < st->n; i++) names[i] = st->e[i].name;
+      Args prog = { NULL, 0, 0 };
+      if (ntok == 256) err = 5;
+      else if (!Compile(ntok, tok, 0, st->n, names, 2, &prog)) err = 3;
+      else err = Run(st, prog.n, prog.v, 0);
+      ArgsFree(&prog);
+      if (reported) InstrScopeClear();   // so that a long session never fills them
+    }
+    if (err != 0) {
+      printf("ERR %d ", err);
+      printf(errors[err], ImageErrMsg());
+      printf("\n");
+    } else if (st->n > 0) {
+      Image curr = st->e[st->n-1].img;
+      printf("OK %d %d %d\n", st->n, ImageWidth(curr), ImageHeight(curr));
+    } else {
+      printf("OK 0\n");
+    }
+    fflush(stdout);
+  }
+  free(line);
+  st->autofree = autofree;
+  return quit;
+}
+
+// Serve commands from stdin (if path is NULL), or from clients that
+// connect, one at a time, to a Unix domain socket created at path.
+// Returns an error code.
+static int Serve(State* st, const char* path) {
+  if (path == NULL) {
+    ServeStream(st, stdin);
+    return 0;
+  }
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) return 5;
+  strcpy(addr.sun_path, path);
+  // Only a stale socket left by a previous server may be replaced
+  struct stat sb;
+  if (lstat(path, &sb) == 0) {
+    if (!S_ISSOCK(sb.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", path);
+      return 5;
+    }
+    unlink(path);
+  }
+  int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sfd < 0) return 5;
+  if (bind(sfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sfd, 8) < 0) {
+    close(sfd);
+    return 5;
+  }
+  signal(SIGPIPE, SIG_IGN);   // clients may go away before the reply
+  int err = 0;
+  int quit = 0;
+  while (!quit) {
+    int cfd = accept(sfd, NULL, NULL);
+    if (cfd < 0) {
+      if (errno == EINTR) continue;
+      err = 5;
+      break;
+    }
+    FILE* in = fdopen(cfd, "r");
+    if (in == NULL) { close(cfd); continue; }
+    // Redirect stdout to the client during the session
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(cfd, STDOUT_FILENO);
+    quit = ServeStream(st, in);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    fclose(in);
+  }
+  close(sfd);
+  unlink(path);
+  return err;
+}
+
+// Run the pipeline of operations av[k..ac-1] on state st.
+// Returns an error code (an index into errors).
+static int Run(State* st, int ac, char* av[], int k) {
+  int err = 0;
+  int x, y, w, h;
+  int n = st->n;
+
+  int timed = 0;
   while (k < ac) {
+    // Time every operation, except those that manage the scopes themselves
+    timed = !st->worker &&
+                strcmp(av[k], "begin") != 0 && strcmp(av[k], "end") != 0 &&
+                strcmp(av[k], "report") != 0;
+    if (timed) InstrScopeBegin(av[k]);
+    // Operations use CURR and PRED, which must be resident
+    for (int i = MAX(n-2, 0); i < n; i++) {
+      if ((err = Restore(st, i)) != 0) break;
+    }
+    if (err != 0) break;
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
+      LOG("Info on I%d\n", n-1);
       uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
+      w = ImageWidth(st->e[n-1].img);
+      h = ImageHeight(st->e[n-1].img);
+      uint8 maxval = ImageMaxval(st->e[n-1].img);
+      ImageStats(st->e[n-1].img, &min, &max);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+    } else if (strcmp(av[k], "cache") == 0) {
+      if (n < 1) { err = 2; break; }
+      LOG("Cache on I%d\n", n-1);
+      if (!ImageCacheEnable(st->e[n-1].img)) { err = 4; break; }
+    } else if (strcmp(av[k], "probe") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int maxval;
+      int64_t offset;
+      if (ImageProbe(av[k], &w, &h, &maxval, &offset) == 0) { err = 4; break; }
+      printf("# Probe %s: %dx%d maxval %d offset %" PRId64 "\n", av[k], w, h, maxval, offset);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+      if (st->pool != NULL) {
+        ImagePoolStat ps;
+        ImagePoolGetStat(st->pool, &ps);
+        printf("# Image pool: %lu hits, %lu misses, %lu evictions, %zu bytes cached\n",
+               ps.hits, ps.misses, ps.evictions, ps.cached);
+      }
+    } else if (strcmp(av[k], "perf") == 0) {
+      int hw = InstrPerfOpen();
+      LOG("Opened %d hardware counters\n", hw);
+    } else if (strcmp(av[k], "begin") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      InstrScopeBegin(av[k]);
+    } else if (strcmp(av[k], "end") == 0) {
+      InstrScopeEnd(n > 0 ? (unsigned long)ImageWidth(st->e[n-1].img)*ImageHeight(st->e[n-1].img) : 0ul);
+    } else if (strcmp(av[k], "report") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (strcmp(av[k], "text") == 0) InstrReport(stdout, INSTR_TEXT);
+      else if (strcmp(av[k], "csv") == 0) InstrReport(stdout, INSTR_CSV);
+      else if (strcmp(av[k], "json") == 0) InstrReport(stdout, INSTR_JSON);
+      else { err = 5; break; }
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Negating I%d\n", n-1);
+      ImageNegative(st->e[n-1].img);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Thresholding I%d at %d\n", n-1, thr);
+      ImageThreshold(st->e[n-1].img, (uint8)thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Brightening I%d by %lf\n", n-1, factor);
+      ImageBrighten(st->e[n-1].img, factor);
+    } else if (OpMatches(av[k], "neg@") || OpMatches(av[k], "thr@") ||
+               OpMatches(av[k], "bri@") || OpMatches(av[k], "blur@")) {
+      // Region of interest: NAME@X,Y,W,H
+      const char* op = av[k];
+      char extra;
+      if (!OpMatches(op, "neg@") && ++k >= ac) { err = 1; break; }   // operand
+      if (n < 1) { err = 2; break; }
+      if (sscanf(strchr(op, '@') + 1, "%d,%d,%d,%d%c", &x, &y, &w, &h, &extra) != 4) { err = 5; break; }
+      if (w < 0 || h < 0 || !ImageValidRect(st->e[n-1].img, x, y, w, h)) { err = 6; break; }
+      Image img = st->e[n-1].img;
+      if (OpMatches(op, "neg@")) {
+        if ((err = Settle(st, n-1)) != 0) break;
+        LOG("Negating I%d (%d,%d,%d,%d)\n", n-1, x, y, w, h);
+        ImageNegativeRect(img, x, y, w, h);
+      } else if (OpMatches(op, "thr@")) {
+        uint8 thr;
+        if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+        if ((err = Settle(st, n-1)) != 0) break;
+        LOG("Thresholding I%d (%d,%d,%d,%d) at %d\n", n-1, x, y, w, h, thr);
+        ImageThresholdRect(img, x, y, w, h, thr);
+      } else if (OpMatches(op, "bri@")) {
+        double factor;
+        if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
+        if ((err = Settle(st, n-1)) != 0) break;
+        LOG("Brightening I%d (%d,%d,%d,%d) by %lf\n", n-1, x, y, w, h, factor);
+        ImageBrightenRect(img, x, y, w, h, factor);
+      } else {
+        int dx, dy;
+        if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) { err = 5; break; }
+        if ((err = Settle(st, n-1)) != 0) break;
+        if ((err = NeedWorkspace(st)) != 0) break;
+        LOG("Blur I%d (%d,%d,%d,%d) with %dx%d mean filter\n", n-1, x, y, w, h, 2*dx+1, 2*dy+1);
+        if (!ImageBlurRectWS(img, x, y, w, h, dx, dy, st->ws)) { err = 4; break; }
+      }
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
+      if ((err = Grow(st, n+1)) != 0) break;
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
+      LOG("Creating black image (%d,%d) -> I%d\n", w, h, n);
+      st->e[n].img = ImageCreate(w, h, PixMax);
+      if (st->e[n].img == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
+      if ((err = Grow(st, n+1)) != 0) break;
+      LOG("Rotating I%d -> I%d\n", n-1, n);
+      st->e[n].img = ImageRotate(st->e[n-1].img);
+      if (st->e[n].img == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "turn") == 0) {
+      if (n < 1) { err = 2; break; }
+      if ((err = Grow(st, n+1)) != 0) break;
+      LOG("Turning I%d -> I%d\n", n-1, n);
+      st->e[n].img = ImageRotate180(st->e[n-1].img);
+      if (st->e[n].img == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "xform") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if ((err = Grow(st, n+1)) != 0) break;
+      ImageView v;
+      if (!MakeView(&v, av[k], st->e[n-1].img)) { err = 5; break; }
+      LOG("Transforming I%d by %s -> I%d\n", n-1, av[k], n);
+      st->e[n].img = ImageMaterialize(v);
+      if (st->e[n].img == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "lut") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      uint8 lut[PixMax+1];
+      if (!MakeLUT(lut, av[k], ImageMaxval(st->e[n-1].img))) { err = 5; break; }
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Mapping levels of I%d by %s\n", n-1, av[k]);
+      ImageMapLevels(st->e[n-1].img, lut);
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
+      if ((err = Grow(st, n+1)) != 0) break;
+      LOG("Mirroring I%d -> I%d\n", n-1, n);
+      st->e[n].img = ImageMirror(st->e[n-1].img);
+      if (st->e[n].img == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
+      if ((err = Grow(st, n+1)) != 0) break;
+      int mx = 0, my = 0;
+      int nf = sscanf(av[k], "%d,%d,%d,%d,%d,%d", &x, &y, &w, &h, &mx, &my);
+      if (nf != 4 && nf != 6) { err = 5; break; }
+      if (!ImageValidRect(st->e[n-1].img, x, y, w, h)) { err = 5; break; }   // precondition check!
+      if (mx < 0 || my < 0) { err = 5; break; }
+      if (nf == 6) {   // expand by margin, within the image
+        int x1 = (int)MIN((int64_t)x + w + mx, ImageWidth(st->e[n-1].img));
+        int y1 = (int)MIN((int64_t)y + h + my, ImageHeight(st->e[n-1].img));
+        x = MAX(x - mx, 0);
+        y = MAX(y - my, 0);
+        w = x1 - x;
+        h = y1 - y;
+      }
+      LOG("Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      st->e[n].img = ImageCrop(st->e[n-1].img, x, y, w, h);
+      if (st->e[n].img == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      w = ImageWidth(st->e[n-2].img);
+      h = ImageHeight(st->e[n-2].img);
+      if (!ImageValidRect(st->e[n-1].img, x, y, w, h)) { err = 6; break; }
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      ImagePaste(st->e[n-1].img, x, y, st->e[n-2].img);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       double alpha;
       if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      w = ImageWidth(st->e[n-2].img);
+      h = ImageHeight(st->e[n-2].img);
+      if (!ImageValidRect(st->e[n-1].img, x, y, w, h)) { err = 6; break; }
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+      ImageBlend(st->e[n-1].img, x, y, st->e[n-2].img, alpha);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
+      if ((err = NeedWorkspace(st)) != 0) break;
+      LOG("Locating I%d in I%d\n", n-2, n-1);
+      int found = ImageLocateSubImageWS(st->e[n-1].img, &x, &y, st->e[n-2].img, st->ws);
+      if (found < 0) { err = 4; break; }
+      if (found) {
         printf("# FOUND (%d,%d)\n", x, y);
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "compare") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
+      w = ImageWidth(st->e[n-2].img);
+      h = ImageHeight(st->e[n-2].img);
+      if (!ImageValidRect(st->e[n-1].img, x, y, w, h)) { err = 6; break; }
+      LOG("Comparing I%d with I%d@(%d,%d)\n", n-2, n-1, x, y);
+      ImageCmp cmp;
+      ImageCompare(st->e[n-1].img, x, y, st->e[n-2].img, &cmp);
+      printf("# MISMATCHES %lu MAXERR %d MSE %.6f PSNR %.3f\n",
+             cmp.mismatches, cmp.maxerr, cmp.mse, cmp.psnr);
+    } else if (strcmp(av[k], "diff") == 0) {
+      if (n < 2) { err = 2; break; }
+      if (ImageWidth(st->e[n-1].img) != ImageWidth(st->e[n-2].img) ||
+          ImageHeight(st->e[n-1].img) != ImageHeight(st->e[n-2].img)) { err = 8; break; }
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Differencing I%d with I%d\n", n-1, n-2);
+      ImageAbsDiff(st->e[n-1].img, st->e[n-2].img);
+    } else if (strcmp(av[k], "motion") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      if (ImageWidth(st->e[n-1].img) != ImageWidth(st->e[n-2].img) ||
+          ImageHeight(st->e[n-1].img) != ImageHeight(st->e[n-2].img)) { err = 8; break; }
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Motion mask of I%d with I%d at %d\n", n-1, n-2, thr);
+      unsigned long changed = ImageDiffThreshold(st->e[n-1].img, st->e[n-2].img, thr, &x, &y, &w, &h);
+      printf("# CHANGED %lu (%d,%d,%d,%d)\n", changed, x, y, w, h);
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      if ((err = Settle(st, n-1)) != 0) break;
+      if ((err = NeedWorkspace(st)) != 0) break;
+      LOG("Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      if (!ImageBlurWS(st->e[n-1].img, dx, dy, st->ws)) { err = 4; break; }
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma;
+      if (sscanf(av[k], "%lf", &sigma) != 1) { err = 5; break; }
+      if (!(sigma >= 0.0)) { err = 5; break; }   // precondition check!
+      if ((err = Settle(st, n-1)) != 0) break;
+      if ((err = NeedWorkspace(st)) != 0) break;
+      LOG("Blur I%d with Gaussian filter of sigma %g\n", n-1, sigma);
+      if (!ImageGaussianBlurWS(st->e[n-1].img, sigma, st->ws)) { err = 4; break; }
+    } else if (strcmp(av[k], "map") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if ((err = Grow(st, n+1)) != 0) break;
+      LOG("Mapping %s -> I%d\n", av[k], n);
+      st->e[n].img = ImageLoadMapped(av[k]);
+      if (st->e[n].img == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "band") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d", &st->band) != 1 || st->band <= 0) { err = 5; break; }
+    } else if (strcmp(av[k], "stream") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      const char* in = av[++k];
+      const char* out = av[++k];
+      StreamOp ops[32];
+      int nops = 0;
+      while (k + 1 < ac && err == 0) {
+        if (nops >= 32) { err = 3; break; }
+        StreamOp* op = &ops[nops++];
+        k++;
+        if (strcmp(av[k], "neg") == 0) {
+          op->code = STREAM_NEG;
+        } else if (strcmp(av[k], "thr") == 0) {
+          if (++k >= ac) { err = 1; break; }
+          op->code = STREAM_THR;
+          if (sscanf(av[k], "%hhu", &op->thr) != 1) { err = 5; break; }
+        } else if (strcmp(av[k], "bri") == 0) {
+          if (++k >= ac) { err = 1; break; }
+          op->code = STREAM_BRI;
+          if (sscanf(av[k], "%lf", &op->factor) != 1) { err = 5; break; }
+        } else if (strcmp(av[k], "blur") == 0) {
+          if (++k >= ac) { err = 1; break; }
+          op->code = STREAM_BLUR;
+          if (sscanf(av[k], "%d,%d", &op->dx, &op->dy) != 2) { err = 5; break; }
+          if (op->dx < 0 || op->dy < 0) { err = 5; break; }   // precondition check!
+        } else {
+          err = 5; break;
+        }
+      }
+      if (err != 0) break;
+      LOG("Streaming %s -> %s with %d operations in bands of %d rows\n", in, out, nops, st->band);
+      if (ImageStream(in, out, st->band, nops, ops) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "frames") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      LOG("Processing frames %s -> %s\n", av[k+1], av[k+2]);
+      err = RunFrames(st, av[k+1], av[k+2], ac, av, k+3);
+      if (timed) InstrScopeEnd(0);
+      st->n = n;
+      return err;   // remaining operations were applied to the frames
+    } else if (strcmp(av[k], "jobs") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d", &st->jobs) != 1 || st->jobs <= 0) { err = 5; break; }
+    } else if (strcmp(av[k], "prefetch") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d", &st->prefetch) != 1 || st->prefetch < 0) { err = 5; break; }
+    } else if (strcmp(av[k], "writeq") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d", &st->writeq) != 1 || st->writeq < 0 || st->writeq > 64) { err = 5; break; }
+    } else if (strcmp(av[k], "batch") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      const char* templ = av[k];
+      glob_t g;
+      int end;
+      int ninputs = CollectInputs(ac, av, k+1, &g, &end);
+      if (ninputs < 0) { err = 5; break; }
+      LOG("Batch of %d files -> %s with %d workers\n", ninputs, templ, st->jobs);
+      if (ninputs > 0) err = RunBatch(st, templ, g.gl_pathv, ninputs, ac, av, end);
+      if (ninputs > 0) globfree(&g);
+      if (timed) InstrScopeEnd(0);
+      st->n = n;
+      return err;   // remaining operations were applied to every file
+    } else if (strcmp(av[k], "serve") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      const char* path = strcmp(av[k], "-") == 0 ? NULL : av[k];
+      LOG("Serving commands from %s\n", path != NULL ? path : "stdin");
+      st->n = n;
+      err = Serve(st, path);
+      n = st->n;
+      if (err != 0) break;
+    } else if (strcmp(av[k], "as") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      st->n = n;
+      int i = Find(st, av[k]);
+      if (i >= 0) { free(st->e[i].name); st->e[i].name = NULL; }   // rename
+      free(st->e[n-1].name);
+      if ((st->e[n-1].name = strdup(av[k])) == NULL) { err = 3; break; }
+      LOG("Naming I%d %s\n", n-1, av[k]);
+    } else if (strcmp(av[k], "use") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      st->n = n;
+      int i = Find(st, av[k]);
+      if (i < 0) { err = 5; break; }
+      LOG("Using I%d %s -> I%d\n", i, av[k], n-1);
+      Raise(st, i);
+      if ((err = Restore(st, n-1)) != 0) break;
+    } else if (strcmp(av[k], "pool") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%lf", &st->poolmb) != 1 || st->poolmb < 0.0) { err = 5; break; }
+      NewPool(st);
+    } else if (strcmp(av[k], "budget") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      double mb;
+      if (sscanf(av[k], "%lf", &mb) != 1 || mb < 0.0) { err = 5; break; }
+      st->budget = (size_t)(mb * 1024 * 1024);
+    } else if (strcmp(av[k], "keep") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int keep;
+      if (sscanf(av[k], "%d", &keep) != 1 || keep < 0) { err = 5; break; }
+      st->n = n;
+      err = Release(st, MIN(keep, n));
+      n = st->n;
+      if (err != 0) break;
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if ((err = Settle(st, n-1)) != 0) break;
+      LOG("Saving %s <- I%d\n", av[k], n-1);
+      // Written in the background, while the next operations proceed
+      if ((st->e[n-1].job = ImageSaveAsync(st->e[n-1].img, av[k])) == NULL) { err = 4; break; }
     } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
+      if ((err = Grow(st, n+1)) != 0) break;
+      LOG("Loading %s -> I%d\n", av[k], n);
+      st->e[n].img = ImageLoad(av[k]);
+      if (st->e[n].img == NULL) { err = 4; break; }
       n++;
     }
+    // Pixels processed are estimated by the size of CURR
+    if (timed) InstrScopeEnd(n > 0 ? (unsigned long)ImageWidth(st->e[n-1].img)*ImageHeight(st->e[n-1].img) : 0ul);
+    timed = 0;
     k++;
+    // Free dead images and spill cold ones
+    st->n = n;
+    if ((err = Collect(st, ac, av, k)) != 0 || (err = Evict(st)) != 0) break;
+    n = st->n;
   }
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  if (err != 0 && timed) InstrScopeEnd(0);   // close scope of failed operation
+  st->n = n;
+  return err;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
   }
 
+  ImageInit();
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  State st = { .e = NULL, .cap = 0, .n = 0, .band = 64,
+               .jobs = (cpus > 0) ? (int)cpus : 1, .prefetch = 2, .writeq = 2,
+               .worker = 0, .autofree = 1, .budget = 0, .poolmb = 64.0,
+               .pool = NULL, .ws = NULL, .tick = 0 };
+  NewPool(&st);
+  // Compile the pipeline, unless -O0 is given
+  Args prog = { NULL, 0, 0 };
+  int err = 0;
+  if (strcmp(av[1], "-O0") == 0) {
+    err = Run(&st, ac, av, 2);
+  } else if (!Compile(ac, av, 1, 0, NULL, 0, &prog)) {
+    err = 3;
+  } else {
+    int same = (prog.n == ac - 1);
+    for (int i = 0; same && i < prog.n; i++) same = strcmp(prog.v[i], av[i+1]) == 0;
+    if (!same) {
+      fprintf(stderr, "Pipeline:");
+      for (int i = 0; i < prog.n; i++) fprintf(stderr, " %s", prog.v[i]);
+      fprintf(stderr, "\n");
+    }
+    err = Run(&st, prog.n, prog.v, 0);
+  }
+
+  InstrPerfClose();
+  // Destroy remaining images
+  int e = Release(&st, 0);
+  if (err == 0) err = e;
+
+  FreePool(&st);
+  ArgsFree(&prog);
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
 }
@@ -22,10 +22,14 @@
 #include "instrumentation.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (monotonic) time in seconds
+double wall_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -42,6 +46,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,6 +78,124 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // already measures elapsed (wall-clock) time
+}
+
+#endif
+
+/// Hardware performance counters
+
+// Names of the hardware counters, in the order of the InstrHW array
+static const char* hwName[NUMHWCOUNTERS] = {
+  "cycles", "instructions", "L1D-misses", "LLC-misses", "dTLB-misses"
+};
+
+/// Values of hardware counters read on previous InstrPrint (-1 if n/a):
+long long InstrHW[NUMHWCOUNTERS];  ///extern
+
+#if defined(__linux__)
+
+//
+// GNU/Linux code to access hardware counters through perf_event_open(2)
+//
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// File descriptors of open counters (-1 if not open)
+static int hwFd[NUMHWCOUNTERS] = {-1, -1, -1, -1, -1};
+
+// Open one counter for the calling process, any cpu, user space only.
+static int perfOpen(unsigned int type, unsigned long long config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // To scale counts when the kernel has to multiplex counters
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define CACHE_READ_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+int InstrPerfOpen(void) { ///
+  static const struct { unsigned int type; unsigned long long config; }
+  event[NUMHWCOUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL) },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+  };
+  int n = 0;
+  int errsave = errno;  // failures are expected and not errors
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    if (hwFd[i] < 0) {
+      hwFd[i] = perfOpen(event[i].type, event[i].config);
+      if (hwFd[i] >= 0) {  // start counting now, not only at the next reset
+        ioctl(hwFd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(hwFd[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+    if (hwFd[i] >= 0) n++;
+  }
+  errno = errsave;
+  return n;
+}
+
+void InstrPerfClose(void) { ///
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    if (hwFd[i] >= 0) close(hwFd[i]);
+    hwFd[i] = -1;
+  }
+}
+
+// Reset and start all open counters.
+static void perfReset(void) {
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    if (hwFd[i] < 0) continue;
+    ioctl(hwFd[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(hwFd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+// Read all counters into InstrHW (-1 if n/a).  Returns number read.
+static int perfRead(void) {
+  int n = 0;
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    unsigned long long v[3];  // value, time enabled, time running
+    InstrHW[i] = -1;
+    if (hwFd[i] < 0 || read(hwFd[i], v, sizeof(v)) != sizeof(v)) continue;
+    if (v[2] > 0 && v[2] < v[1])   // multiplexed: extrapolate
+      v[0] = (unsigned long long)((double)v[0] * v[1] / v[2]);
+    InstrHW[i] = (long long)v[0];
+    n++;
+  }
+  return n;
+}
+
+#else
+
+int InstrPerfOpen(void) { return 0; }  // not supported
+
+void InstrPerfClose(void) { }
+
+static void perfReset(void) { }
+
+static int perfRead(void) {
+  for (int i = 0; i < NUMHWCOUNTERS; i++) InstrHW[i] = -1;
+  return 0;
+}
+
 #endif
 
 /// Array of operation counters:
@@ -105,6 +235,7 @@ void InstrCalibrate(void) { ///
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  perfReset();
   InstrTime = cpu_time();
 }
 
@@ -125,5 +256,130 @@ void InstrPrint(void) { ///
     if (InstrName[i] != NULL)
       printf("\t%15lu", InstrCount[i]);  
   puts("");
+
+  // Hardware counters (if any were opened with InstrPerfOpen)
+  if (perfRead() == 0) return;
+  // Rates are given per unit of the first counter (pixmem, for instance)
+  double units = (double)InstrCount[0];
+  printf("#%14.15s", hwName[0]);
+  for (int i = 1; i < NUMHWCOUNTERS; i++)
+    printf("\t%15.15s", hwName[i]);
+  printf("\t%15.15s", "IPC");
+  for (int i = 2; i < NUMHWCOUNTERS; i++)
+    printf("\t%11.11s/%-3.3s", hwName[i], InstrName[0] != NULL ? InstrName[0] : "c0");
+  puts("");
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    if (InstrHW[i] < 0) printf("%s%15s", i > 0 ? "\t" : "", "n/a");
+    else printf("%s%15lld", i > 0 ? "\t" : "", InstrHW[i]);
+  }
+  if (InstrHW[0] > 0 && InstrHW[1] >= 0)
+    printf("\t%15.3f", (double)InstrHW[1] / (double)InstrHW[0]);
+  else
+    printf("\t%15s", "n/a");
+  for (int i = 2; i < NUMHWCOUNTERS; i++) {
+    if (InstrHW[i] >= 0 && units > 0.0) printf("\t%15.6f", (double)InstrHW[i] / units);
+    else printf("\t%15s", "n/a");
+  }
+  puts("");
 }
 
+
+/// Timing scopes
+
+// Stack of open scopes
+static struct {
+  char name[32];   // copy of the name (the caller's string may not outlive the scope)
+  double wall;
+  double cpu;
+} scopeStack[MAXSCOPEDEPTH];
+static int scopeDepth = 0;   // number of open scopes
+static int scopeLost = 0;    // open/close requests that could not be honored
+
+// Finished scopes
+static InstrScope scopeRecord[MAXSCOPES];
+static int scopeCount = 0;
+static unsigned long scopeDropped = 0;   // finished scopes not recorded (list full)
+
+void InstrScopeBegin(const char* name) { ///
+  if (scopeDepth >= MAXSCOPEDEPTH) { scopeLost++; return; }
+  snprintf(scopeStack[scopeDepth].name, sizeof(scopeStack[scopeDepth].name), "%s", name);
+  scopeStack[scopeDepth].cpu = cpu_time();
+  scopeStack[scopeDepth].wall = wall_time();
+  scopeDepth++;
+}
+
+void InstrScopeEnd(unsigned long pixels) { ///
+  double wall = wall_time();
+  double cpu = cpu_time();
+  if (scopeLost > 0) { scopeLost--; return; }  // matches a dropped Begin
+  if (scopeDepth == 0) return;                   // unbalanced End: ignore
+  scopeDepth--;
+  if (scopeCount >= MAXSCOPES) { scopeDropped++; return; }
+  InstrScope* r = &scopeRecord[scopeCount++];
+  snprintf(r->name, sizeof(r->name), "%s", scopeStack[scopeDepth].name);
+  r->depth = scopeDepth;
+  r->wall = wall - scopeStack[scopeDepth].wall;
+  r->cpu = cpu - scopeStack[scopeDepth].cpu;
+  r->pixels = pixels;
+}
+
+void InstrScopeClear(void) { ///
+  scopeCount = 0;
+  scopeDropped = 0;
+}
+
+int InstrScopeCount(void) { ///
+  return scopeCount;
+}
+
+unsigned long InstrScopeDropped(void) { ///
+  return scopeDropped;
+}
+
+const InstrScope* InstrScopeGet(int i) { ///
+  return (0 <= i && i < scopeCount) ? &scopeRecord[i] : NULL;
+}
+
+// Throughput of a scope in MB/s (0 if unknown)
+static double scopeMBps(const InstrScope* r) {
+  return (r->wall > 0.0) ? (double)r->pixels / r->wall * 1.0e-6 : 0.0;
+}
+
+void InstrReport(FILE* f, int format) { ///
+  switch (format) {
+  case INSTR_CSV:
+    fprintf(f, "name,depth,wall_s,cpu_s,pixels,mb_per_s\n");
+    for (int i = 0; i < scopeCount; i++) {
+      InstrScope* r = &scopeRecord[i];
+      fprintf(f, "%s,%d,%.9f,%.9f,%lu,%.3f\n",
+              r->name, r->depth, r->wall, r->cpu, r->pixels, scopeMBps(r));
+    }
+    break;
+  case INSTR_JSON:
+    fprintf(f, "[");
+    for (int i = 0; i < scopeCount; i++) {
+      InstrScope* r = &scopeRecord[i];
+      fprintf(f, "%s\n  {\"name\": \"", i > 0 ? "," : "");
+      for (const char* c = r->name; *c != '\0'; c++) {  // escape for JSON
+        if (*c == '"' || *c == '\\') fputc('\\', f);
+        fputc(*c, f);
+      }
+      fprintf(f, "\", \"depth\": %d, \"wall_s\": %.9f, \"cpu_s\": %.9f, "
+                 "\"pixels\": %lu, \"mb_per_s\": %.3f}",
+              r->depth, r->wall, r->cpu, r->pixels, scopeMBps(r));
+    }
+    fprintf(f, "\n]\n");
+    break;
+  default:
+    fprintf(f, "#%14.15s\t%15.15s\t%15.15s\t%15.15s\t%15.15s\n",
+            "scope", "wall", "cpu", "pixels", "MB/s");
+    for (int i = 0; i < scopeCount; i++) {
+      InstrScope* r = &scopeRecord[i];
+      int indent = 2*(r->depth < 7 ? r->depth : 7);  // show nesting
+      fprintf(f, "%*s%-*.*s\t%15.6f\t%15.6f\t%15lu\t%15.3f\n",
+              indent, "", 15 - indent, 15 - indent, r->name,
+              r->wall, r->cpu, r->pixels, scopeMBps(r));
+    }
+    if (scopeDropped > 0) fprintf(f, "# %lu scopes dropped (more than %d)\n", scopeDropped, MAXSCOPES);
+  }
+}
@@ -22,9 +22,14 @@
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (monotonic) time in seconds
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
@@ -48,7 +53,88 @@ void InstrCalibrate(void) ;
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print time and named counters since last reset.
+/// If hardware counters are open (see InstrPerfOpen), also print them,
+/// together with IPC and misses per unit of InstrCount[0].
 void InstrPrint(void) ;
 
+/// Hardware performance counters
+///
+/// On GNU/Linux, cpu cycles, instructions, L1D, LLC and dTLB read misses
+/// may be measured using perf_event_open(2).  Counters start when opened,
+/// are reset by InstrReset and read by InstrPrint.  Counters that cannot be opened
+/// (no hardware support, virtual machine, perf_event_paranoid, other OS)
+/// are simply reported as n/a.
+
+/// Number of hardware counters
+#define NUMHWCOUNTERS 5
+
+/// Values of hardware counters read on previous InstrPrint (-1 if n/a):
+/// cycles, instructions, L1D misses, LLC misses, dTLB misses.
+extern long long InstrHW[NUMHWCOUNTERS];  ///extern
+
+/// Try to open the hardware counters.
+/// Returns the number of counters available (0 if none).
+int InstrPerfOpen(void) ;
+
+/// Close all hardware counters.
+void InstrPerfClose(void) ;
+
+/// Timing scopes
+///
+/// Named scopes measure wall-clock and cpu time of a region of code.
+/// Scopes may be nested (up to MAXSCOPEDEPTH levels); each finished scope
+/// is appended to a list of records (up to MAXSCOPES; extra ones are
+/// dropped, but counted by InstrScopeDropped), which may be printed with
+/// InstrReport:
+///
+/// InstrScopeBegin("blur");
+/// ImageBlur(img, 7, 7);
+/// InstrScopeEnd(npixels);  // pixels processed, used to derive MB/s
+
+/// Maximum nesting depth of scopes
+#define MAXSCOPEDEPTH 16
+
+/// Maximum number of finished scopes recorded
+#define MAXSCOPES 4096
+
+/// Record of a finished scope
+typedef struct {
+  char name[32];         // scope name (truncated)
+  int depth;             // nesting depth (0 = outermost)
+  double wall;           // elapsed wall-clock time (s)
+  double cpu;            // elapsed cpu time (s)
+  unsigned long pixels;  // pixels processed
+} InstrScope;
+
+/// Formats for InstrReport
+enum { INSTR_TEXT, INSTR_CSV, INSTR_JSON };
+
+/// Open a new (possibly nested) scope.
+void InstrScopeBegin(const char* name) ;
+
+/// Close the innermost open scope and record it.
+/// pixels is the number of pixels processed within the scope (may be 0).
+void InstrScopeEnd(unsigned long pixels) ;
+
+/// Discard all recorded scopes (open scopes are kept), and reset the
+/// count of dropped ones.
+void InstrScopeClear(void) ;
+
+/// Number of recorded scopes
+int InstrScopeCount(void) ;
+
+/// Number of finished scopes dropped because the list was full
+unsigned long InstrScopeDropped(void) ;
+
+/// Get the i-th recorded scope (0 <= i < InstrScopeCount()).
+const InstrScope* InstrScopeGet(int i) ;
+
+/// Print recorded scopes to f, in the given format (INSTR_TEXT, INSTR_CSV
+/// or INSTR_JSON), with time per scope and throughput in MB/s
+/// (one pixel = one byte).  The text format also reports the number of
+/// dropped scopes, if any.
+void InstrReport(FILE* f, int format) ;
+
 #endif
 